@@ -0,0 +1,468 @@
+#include "coroutine.hpp"
+#include "deadline.hpp"
+#include "parallel.hpp"
+#include "strand.hpp"
+#include "taskgroup.hpp"
+#include "threadpool.hpp"
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdlib>
+#include <functional>
+#include <iostream>
+#include <new>
+#include <numeric>
+#include <random>
+
+// global allocation counter, used to verify allocation free dispatching
+static std::atomic<size_t> s_Allocations = 0;
+void* operator new(size_t size) {
+    s_Allocations.fetch_add(1, std::memory_order_relaxed);
+    if (void* ptr = std::malloc(size))
+        return ptr;
+    throw std::bad_alloc();
+}
+void operator delete(void* ptr) noexcept { std::free(ptr); }
+void operator delete(void* ptr, size_t) noexcept { std::free(ptr); }
+
+template <typename _Function> static double measureSeconds(_Function&& foo) {
+    const auto start = std::chrono::steady_clock::now();
+    foo();
+    const std::chrono::duration<double> elapsed =
+        std::chrono::steady_clock::now() - start;
+    return elapsed.count();
+}
+
+static void spinUntil(const std::atomic<size_t>& counter, size_t target) {
+    while (counter.load() < target)
+        std::this_thread::yield();
+}
+
+// a few external roots, every root fans out into many tiny tasks from inside
+// the pool, the pattern work stealing is made for
+static void benchmarkWorkStealing() {
+    constexpr size_t numRoots = 64;
+    constexpr size_t numChildren = 4096;
+
+    for (const bool workStealing : {false, true}) {
+        ThreadPoolOptions options;
+        options.workStealing = workStealing;
+        ThreadPool pool(options);
+        std::atomic<size_t> counter = 0;
+
+        const double seconds = measureSeconds([&] {
+            for (size_t i = 0; i < numRoots; ++i)
+                pool.dispatchWork([&] {
+                    for (size_t j = 0; j < numChildren; ++j)
+                        pool.dispatchWork(
+                            [&counter] { counter.fetch_add(1); });
+                });
+            spinUntil(counter, numRoots * numChildren);
+        });
+        std::cout << (workStealing ? "work stealing: " : "single queue:  ")
+                  << numRoots * numChildren / seconds / 1e6
+                  << " Mtasks/s\n";
+    }
+}
+
+// tasks with a return value, measures throughput and heap allocations
+static void benchmarkDispatch() {
+    constexpr size_t numRounds = 64;
+    constexpr size_t numTasks = 4096;
+
+    ThreadPool pool;
+    std::vector<Future<size_t>> futures;
+    futures.reserve(numTasks);
+    size_t allocations = 0, sum = 0;
+
+    const double seconds = measureSeconds([&] {
+        for (size_t round = 0; round < numRounds; ++round) {
+            const size_t before = s_Allocations.load();
+            for (size_t i = 0; i < numTasks; ++i)
+                futures.push_back(pool.dispatchWork(
+                    [round](size_t a, size_t b) { return round + a * b; }, i,
+                    size_t(3)));
+            // the first round warms up the pooled shared states
+            if (round)
+                allocations += s_Allocations.load() - before;
+            for (auto& e : futures)
+                sum += e.get();
+            futures.clear();
+        }
+    });
+    std::cout << "dispatch with future: "
+              << numRounds * numTasks / seconds / 1e6 << " Mtasks/s, "
+              << double(allocations) / ((numRounds - 1) * numTasks)
+              << " allocations/task (checksum " << sum << ")\n";
+#if THREADPOOL_METRICS
+    for (const auto& e : pool.stats().priorities)
+        std::cout << "  priority " << e.priority << ": wait p50 "
+                  << e.wait.percentile(0.5).count() << " ns, p99 "
+                  << e.wait.percentile(0.99).count() << " ns, run p50 "
+                  << e.run.percentile(0.5).count() << " ns\n";
+#endif
+}
+
+// fan out of one job into many chunks, one dispatch per chunk vs one bulk
+static void benchmarkBulkDispatch() {
+    constexpr size_t numRounds = 16;
+    constexpr size_t numChunks = 10000;
+
+    ThreadPool pool;
+    std::vector<size_t> chunks(numChunks);
+    std::iota(chunks.begin(), chunks.end(), size_t(0));
+
+    for (const bool bulk : {false, true}) {
+        std::atomic<size_t> sum = 0;
+        const double seconds = measureSeconds([&] {
+            for (size_t round = 0; round < numRounds; ++round) {
+                auto chunk = [&sum](size_t i) { sum.fetch_add(i); };
+                if (bulk)
+                    pool.dispatchBulk(chunks.begin(), chunks.end(), chunk)
+                        .wait();
+                else {
+                    std::atomic<size_t> done = 0;
+                    for (auto e : chunks)
+                        pool.dispatchWork([&, e] {
+                            chunk(e);
+                            done.fetch_add(1);
+                        });
+                    spinUntil(done, numChunks);
+                }
+            }
+        });
+        std::cout << (bulk ? "dispatchBulk:          " : "dispatchWork per chunk: ")
+                  << numRounds * numChunks / seconds / 1e6
+                  << " Mtasks/s (checksum " << sum << ")\n";
+    }
+}
+
+static double percentile(std::vector<double>& values, double fraction) {
+    auto nth = values.begin() + size_t(fraction * (values.size() - 1));
+    std::nth_element(values.begin(), nth, values.end());
+    return *nth;
+}
+
+// bursts of a few tasks separated by short pauses, like request handling.
+// Measures the time from dispatching a task until a worker starts it, with
+// workers that park right away vs the adaptive spin, yield, park idling
+static void benchmarkWakeLatency() {
+    constexpr size_t numBursts = 2000;
+    constexpr size_t burstSize = 4;
+
+    for (const bool spinning : {false, true}) {
+        ThreadPoolOptions options;
+        if (!spinning)
+            options.spinIterations = options.yieldIterations = 0;
+        ThreadPool pool(options);
+        std::vector<double> latencies(numBursts * burstSize);
+        std::atomic<size_t> done = 0;
+        std::mt19937 random(42);
+        std::uniform_int_distribution<int> pause(10, 200);
+
+        for (size_t burst = 0; burst < numBursts; ++burst) {
+            for (size_t i = 0; i < burstSize; ++i) {
+                const auto dispatched = std::chrono::steady_clock::now();
+                pool.dispatchWork([&, dispatched,
+                                   index = burst * burstSize + i] {
+                    const std::chrono::duration<double, std::micro> latency =
+                        std::chrono::steady_clock::now() - dispatched;
+                    latencies[index] = latency.count();
+                    done.fetch_add(1);
+                });
+            }
+            spinUntil(done, (burst + 1) * burstSize);
+            std::this_thread::sleep_for(
+                std::chrono::microseconds(pause(random)));
+        }
+        std::cout << (spinning ? "spin, yield, park: " : "park right away:   ")
+                  << "dispatch to start p50 " << percentile(latencies, 0.5)
+                  << " us, p99 " << percentile(latencies, 0.99) << " us\n";
+    }
+}
+
+// saturation: every worker is busy with a stream of important tasks which
+// keep dispatching their successors, while low priority tasks trickle in.
+// Measures how long the low priority tasks wait for a worker
+template <typename _Pool> static void benchmarkStarvation(const char* name) {
+    using Clock = std::chrono::steady_clock;
+    constexpr size_t numLow = 100;
+    constexpr auto streamLength = std::chrono::milliseconds(500);
+
+    _Pool pool;
+    const auto end = Clock::now() + streamLength;
+    std::function<void()> important = [&] {
+        const auto until = Clock::now() + std::chrono::microseconds(2);
+        while (Clock::now() < until)
+            ;
+        if (Clock::now() < end)
+            pool.dispatchWork(3, important);
+    };
+    for (size_t i = 0; i < 4 * pool.numThreads(); ++i)
+        pool.dispatchWork(3, important);
+
+    std::vector<double> latencies(numLow);
+    for (size_t i = 0; i < numLow; ++i) {
+        const auto dispatched = Clock::now();
+        pool.dispatchWork(0, [&latencies, dispatched, i] {
+            const std::chrono::duration<double, std::milli> latency =
+                Clock::now() - dispatched;
+            latencies[i] = latency.count();
+        });
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    pool.drain();
+    std::cout << name << ": low priority wait p50 "
+              << percentile(latencies, 0.5) << " ms, max "
+              << percentile(latencies, 1.0) << " ms\n";
+}
+
+// many strands sharing one pool, every task increments its strand's
+// counter without any locking
+static void benchmarkStrands() {
+    constexpr size_t numStrands = 1000;
+    constexpr size_t numTasks = 1 << 18;
+
+    ThreadPool pool;
+    std::vector<std::unique_ptr<Strand>> strands;
+    for (size_t i = 0; i < numStrands; ++i)
+        strands.push_back(std::make_unique<Strand>(pool));
+    std::vector<size_t> counters(numStrands);
+    const double seconds = measureSeconds([&] {
+        for (size_t i = 0; i < numTasks; ++i)
+            strands[i % numStrands]->post(
+                [&counters, index = i % numStrands] { ++counters[index]; });
+        pool.drain();
+    });
+    std::cout << "strands: " << numStrands << " sharing the pool, "
+              << numTasks / seconds / 1e6 << " Mtasks/s (checksum "
+              << std::accumulate(counters.begin(), counters.end(), size_t(0))
+              << ")\n";
+}
+
+// a dynamic set of tasks waited for as a whole: a future per task vs one
+// task group
+static void benchmarkTaskGroup() {
+    constexpr size_t numRounds = 64;
+    constexpr size_t numTasks = 4096;
+
+    ThreadPool pool;
+    for (const bool group : {false, true}) {
+        std::atomic<size_t> sum = 0;
+        size_t allocations = 0;
+        const double seconds = measureSeconds([&] {
+            std::vector<Future<size_t>> futures;
+            futures.reserve(numTasks);
+            for (size_t round = 0; round < numRounds; ++round) {
+                const size_t before = s_Allocations.load();
+                TaskGroup tasks(pool);
+                for (size_t i = 0; i < numTasks; ++i) {
+                    const auto task = [&sum, i] { return sum.fetch_add(i); };
+                    if (group)
+                        tasks.run(task);
+                    else
+                        futures.push_back(pool.dispatchWork(task));
+                }
+                if (group)
+                    tasks.wait();
+                for (auto& e : futures)
+                    pool.wait(e);
+                futures.clear();
+                if (round)
+                    allocations += s_Allocations.load() - before;
+            }
+        });
+        std::cout << (group ? "task group:        " : "future per task:   ")
+                  << numRounds * numTasks / seconds / 1e6 << " Mtasks/s, "
+                  << double(allocations) / ((numRounds - 1) * numTasks)
+                  << " allocations/task (checksum " << sum << ")\n";
+    }
+}
+
+// cpu microtasks while a stream of tasks stalls on (simulated) I/O, the
+// stalls either occupy the cpu workers or run on the blocking lane
+static void benchmarkBlockingLane() {
+    constexpr size_t numStalls = 64;
+    constexpr size_t numTasks = 1 << 17;
+
+    for (const bool lane : {false, true}) {
+        ThreadPool pool;
+        for (size_t i = 0; i < numStalls; ++i) {
+            auto stall = [] {
+                std::this_thread::sleep_for(std::chrono::milliseconds(5));
+            };
+            // ahead of the cpu tasks
+            if (lane)
+                pool.dispatchBlocking(1, stall);
+            else
+                pool.dispatchWork(1, stall);
+        }
+        std::atomic<size_t> counter = 0;
+        const double seconds = measureSeconds([&] {
+            for (size_t i = 0; i < numTasks; ++i)
+                pool.dispatchWork([&counter] { counter.fetch_add(1); });
+            spinUntil(counter, numTasks);
+        });
+        pool.drain();
+        std::cout << (lane ? "stalls on blocking lane: "
+                           : "stalls on cpu workers:   ")
+                  << numTasks / seconds / 1e6 << " Mtasks/s\n";
+    }
+}
+
+// request deadlines: almost every timer is cancelled before it fires
+static void benchmarkTimers() {
+    constexpr size_t numTimers = 1 << 20;
+
+    ThreadPool pool;
+    std::vector<TimerHandle> timers;
+    timers.reserve(numTimers);
+    const double armSeconds = measureSeconds([&] {
+        for (size_t i = 0; i < numTimers; ++i)
+            timers.push_back(pool.dispatchAfter(
+                std::chrono::seconds(10) + std::chrono::microseconds(i), [] {}));
+    });
+    size_t cancelled = 0;
+    const double cancelSeconds = measureSeconds([&] {
+        for (auto& e : timers)
+            cancelled += e.cancel();
+    });
+    std::cout << "timers: arm " << armSeconds / numTimers * 1e9
+              << " ns, cancel " << cancelSeconds / numTimers * 1e9
+              << " ns (" << cancelled << " cancelled)\n";
+}
+
+// parallel_for/parallel_reduce scaling from one thread up to all cores
+static void benchmarkParallelAlgorithms() {
+    constexpr size_t numItems = 1 << 22;
+    std::vector<double> data(numItems);
+    std::iota(data.begin(), data.end(), 0.0);
+
+    double baseline = 0.0;
+    for (size_t numThreads = 1;
+         numThreads <= std::max(1u, std::thread::hardware_concurrency());
+         ++numThreads) {
+        ThreadPool pool(numThreads);
+        double sum = 0.0;
+        const double seconds = measureSeconds([&] {
+            parallel_for(pool, data.begin(), data.end(),
+                         [](double& e) { e = std::sqrt(e + 1.0); });
+            sum = parallel_reduce(pool, data.begin(), data.end(), 0.0,
+                                  std::plus<>(),
+                                  [](double e) { return std::log(e); });
+        });
+        if (numThreads == 1)
+            baseline = seconds;
+        std::cout << "parallel algorithms, " << numThreads
+                  << " threads: " << seconds * 1e3 << " ms, speedup "
+                  << baseline / seconds << " (checksum " << sum << ")\n";
+    }
+}
+
+static Task<size_t> coroutineHops(ThreadPool<>& pool, size_t hops) {
+    for (size_t i = 0; i < hops; ++i)
+        co_await pool.schedule();
+    co_return hops;
+}
+// many concurrent logical operations, each one hopping through the pool
+static void benchmarkCoroutines() {
+    constexpr size_t numCoroutines = 10000;
+    constexpr size_t numHops = 16;
+
+    ThreadPool pool;
+    std::vector<Future<size_t>> futures;
+    futures.reserve(numCoroutines);
+    size_t sum = 0;
+    const double seconds = measureSeconds([&] {
+        for (size_t i = 0; i < numCoroutines; ++i)
+            futures.push_back(spawn(pool, coroutineHops(pool, numHops)));
+        for (auto& e : futures)
+            sum += e.get();
+    });
+    std::cout << "coroutines: " << numCoroutines << " concurrent, "
+              << sum / seconds / 1e6 << " M resumptions/s\n";
+}
+
+// several producer threads hammering the pool with microtasks
+template <typename _Pool>
+static void benchmarkQueueContention(const char* name,
+                                     const ThreadPoolOptions& options = {}) {
+    constexpr size_t numTasks = 1 << 17;
+    for (size_t numProducers = 1;
+         numProducers <= std::max(4u, std::thread::hardware_concurrency());
+         numProducers *= 2) {
+        _Pool pool(options);
+        std::atomic<size_t> counter = 0;
+        const double seconds = measureSeconds([&] {
+            std::vector<std::thread> producers;
+            for (size_t i = 0; i < numProducers; ++i)
+                producers.emplace_back([&] {
+                    for (size_t j = 0; j < numTasks / numProducers; ++j)
+                        pool.dispatchWork(int(j % 4),
+                                          [&counter] { counter.fetch_add(1); });
+                });
+            for (auto& e : producers)
+                e.join();
+            spinUntil(counter, numTasks / numProducers * numProducers);
+        });
+        std::cout << name << ", " << numProducers
+                  << " producers: " << numTasks / seconds / 1e6
+                  << " Mtasks/s\n";
+    }
+}
+
+// an overloaded pool: requests arrive faster than they can be served, each
+// one with a 2 ms budget. Shedding expired requests keeps the pool working
+// on requests which still can make it
+static void benchmarkDeadlines() {
+    constexpr size_t numRequests = 20000;
+
+    for (const bool shed : {false, true}) {
+        EdfThreadPool pool;
+        DeadlineScheduler scheduler(pool, {shed, {}});
+        const double seconds = measureSeconds([&] {
+            for (size_t i = 0; i < numRequests; ++i) {
+                scheduler.dispatchWithin(std::chrono::milliseconds(2), [] {
+                    const auto end = std::chrono::steady_clock::now() +
+                                     std::chrono::microseconds(20);
+                    while (std::chrono::steady_clock::now() < end)
+                        ;
+                });
+                if (i % 64 == 0)
+                    std::this_thread::sleep_for(std::chrono::microseconds(50));
+            }
+            pool.drain();
+        });
+        const DeadlineStats stats = scheduler.stats();
+        std::cout << (shed ? "edf, shedding: " : "edf, run all:  ")
+                  << stats.onTime << " on time, " << stats.late << " late, "
+                  << stats.shed << " shed, miss rate " << stats.missRate()
+                  << " in " << seconds * 1e3 << " ms\n";
+    }
+}
+
+int main() {
+    benchmarkDispatch();
+    benchmarkWakeLatency();
+    benchmarkQueueContention<ThreadPool<>>("heap queue");
+    benchmarkQueueContention<ThreadPool<int, std::less<int>, LockFreeQueue<>>>(
+        "lock free queue");
+    benchmarkQueueContention<ThreadPool<int, std::less<int>, BucketQueue<4>>>(
+        "bucket queue");
+    ThreadPoolOptions sharded;
+    sharded.submissionShards = 8;
+    benchmarkQueueContention<ThreadPool<>>("sharded heap queue", sharded);
+    benchmarkStarvation<ThreadPool<>>("heap queue");
+    benchmarkStarvation<ThreadPool<int, std::less<int>, AgingQueue<std::kilo>>>(
+        "aging queue");
+    benchmarkBulkDispatch();
+    benchmarkWorkStealing();
+    benchmarkCoroutines();
+    benchmarkStrands();
+    benchmarkTaskGroup();
+    benchmarkBlockingLane();
+    benchmarkTimers();
+    benchmarkDeadlines();
+    benchmarkParallelAlgorithms();
+    return 0;
+}
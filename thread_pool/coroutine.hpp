@@ -0,0 +1,183 @@
+#pragma once
+#include "future.hpp"
+#include <coroutine>
+#include <exception>
+#include <optional>
+#include <type_traits>
+#include <utility>
+
+template <typename _Type = void> class Task;
+
+namespace threadpool_detail {
+
+template <typename _Type> struct TaskPromiseBase {
+    // resumes the awaiting coroutine through symmetric transfer, so long
+    // chains of tasks don't grow the stack
+    struct _FinalAwaiter {
+        bool await_ready() const noexcept { return false; }
+        template <typename _Promise>
+        std::coroutine_handle<>
+            await_suspend(std::coroutine_handle<_Promise> handle) noexcept {
+            auto continuation = handle.promise().continuation;
+            return continuation ? continuation : std::noop_coroutine();
+        }
+        void await_resume() const noexcept {}
+    };
+
+    // destroyed while suspended by anyone but its Task (a dropped Resumer,
+    // see future.hpp): the awaiting coroutine would never resume, it is
+    // destroyed as well, up to the root of the chain
+    ~TaskPromiseBase() {
+        if (this->continuation) {
+            this->owner->m_Handle = nullptr;
+            this->continuation.destroy();
+        }
+    }
+
+    Task<_Type> get_return_object() noexcept;
+    std::suspend_always initial_suspend() const noexcept { return {}; }
+    _FinalAwaiter final_suspend() const noexcept { return {}; }
+    void unhandled_exception() noexcept {
+        this->exception = std::current_exception();
+    }
+
+    std::coroutine_handle<> continuation;
+    // the awaited Task, in the awaiting coroutine's frame
+    Task<_Type>* owner = nullptr;
+    std::exception_ptr exception;
+};
+template <typename _Type> struct TaskPromise final : TaskPromiseBase<_Type> {
+    template <typename _Value> void return_value(_Value&& value) {
+        this->value.emplace(std::forward<_Value>(value));
+    }
+    _Type result() {
+        if (this->exception)
+            std::rethrow_exception(this->exception);
+        return std::move(*this->value);
+    }
+
+    std::optional<_Type> value;
+};
+template <> struct TaskPromise<void> final : TaskPromiseBase<void> {
+    void return_void() const noexcept {}
+    void result() {
+        if (this->exception)
+            std::rethrow_exception(this->exception);
+    }
+};
+
+// coroutine type owning nothing but itself, used to bridge into futures
+struct DetachedCoroutine {
+    struct promise_type {
+        DetachedCoroutine get_return_object() const noexcept { return {}; }
+        std::suspend_never initial_suspend() const noexcept { return {}; }
+        std::suspend_never final_suspend() const noexcept { return {}; }
+        void return_void() const noexcept {}
+        void unhandled_exception() const noexcept { std::terminate(); }
+    };
+};
+
+} // namespace threadpool_detail
+
+// lazily started coroutine, it runs once awaited (or passed to spawn) and
+// resumes its awaiter when done. Suspended coroutines hold no thread, so
+// thousands of them can share a handful of workers
+template <typename _Type> class [[nodiscard]] Task final {
+  public:
+    using promise_type = threadpool_detail::TaskPromise<_Type>;
+
+    Task(Task&& rhs) noexcept
+        : m_Handle(std::exchange(rhs.m_Handle, nullptr)) {}
+    Task& operator=(Task&& rhs) noexcept {
+        if (this != &rhs) {
+            this->_destroy();
+            this->m_Handle = std::exchange(rhs.m_Handle, nullptr);
+        }
+        return *this;
+    }
+    ~Task() { this->_destroy(); }
+
+    auto operator co_await() && noexcept {
+        struct _Awaiter {
+            bool await_ready() const noexcept { return false; }
+            std::coroutine_handle<>
+                await_suspend(std::coroutine_handle<> awaiting) noexcept {
+                this->task->m_Handle.promise().continuation = awaiting;
+                this->task->m_Handle.promise().owner = this->task;
+                return this->task->m_Handle;
+            }
+            _Type await_resume() {
+                return this->task->m_Handle.promise().result();
+            }
+
+            Task* task;
+        };
+        return _Awaiter{this};
+    }
+
+  private:
+    friend struct threadpool_detail::TaskPromiseBase<_Type>;
+    explicit Task(std::coroutine_handle<promise_type> handle)
+        : m_Handle(handle) {}
+
+    // the owner destroying the coroutine leaves its awaiter alone
+    void _destroy() {
+        if (!this->m_Handle)
+            return;
+        this->m_Handle.promise().continuation = nullptr;
+        this->m_Handle.destroy();
+    }
+
+    std::coroutine_handle<promise_type> m_Handle;
+};
+
+template <typename _Type>
+Task<_Type> threadpool_detail::TaskPromiseBase<_Type>::get_return_object()
+    noexcept {
+    return Task<_Type>(std::coroutine_handle<TaskPromise<_Type>>::from_promise(
+        static_cast<TaskPromise<_Type>&>(*this)));
+}
+
+// co_await on a future suspends until it is ready, the coroutine resumes on
+// the future's executor (inline if it has none)
+template <typename _Type> auto operator co_await(Future<_Type>&& future) {
+    struct _Awaiter {
+        bool await_ready() const { return this->future.isReady(); }
+        void await_suspend(std::coroutine_handle<> handle) {
+            using threadpool_detail::Combinators;
+            const auto executor = Combinators::executor(this->future);
+            Combinators::onReady(this->future, [handle, executor] {
+                if (executor)
+                    executor.post(threadpool_detail::Resumer(handle));
+                else
+                    handle.resume();
+            });
+        }
+        _Type await_resume() { return this->future.get(); }
+
+        Future<_Type> future;
+    };
+    return _Awaiter{std::move(future)};
+}
+
+// starts the task on the pool and returns a future for its result
+template <typename _Pool, typename _Type>
+Future<_Type> spawn(_Pool& pool, Task<_Type> task) {
+    Promise<_Type> promise;
+    promise.setExecutor(pool);
+    auto future = promise.getFuture();
+    [](_Pool& pool, Task<_Type> task,
+       Promise<_Type> promise) -> threadpool_detail::DetachedCoroutine {
+        co_await pool.schedule();
+        try {
+            if constexpr (std::is_void_v<_Type>) {
+                co_await std::move(task);
+                promise.setValue();
+            } else
+                promise.setValue(co_await std::move(task));
+        } catch (...) {
+            promise.setException(std::current_exception());
+        }
+    }(pool, std::move(task), std::move(promise));
+    return future;
+}
@@ -0,0 +1,112 @@
+#pragma once
+#include "threadpool.hpp"
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <stdexcept>
+#include <tuple>
+#include <type_traits>
+
+using Deadline = std::chrono::steady_clock::time_point;
+
+// earliest deadline first: the priority is an absolute deadline, the task
+// with the earliest one runs first. Only HeapQueue orders by comparison,
+// the other policies map arithmetic priorities onto fixed levels
+using EdfThreadPool = ThreadPool<Deadline, std::greater<Deadline>, HeapQueue>;
+
+// stored in the future of a task which was shed because its deadline passed
+// before it started
+class DeadlineMissed : public std::runtime_error {
+  public:
+    DeadlineMissed()
+        : std::runtime_error("DeadlineScheduler: deadline passed, task shed") {}
+};
+
+struct DeadlineStats {
+    // finished in time, finished after the deadline, dropped unstarted
+    uint64_t onTime = 0, late = 0, shed = 0;
+
+    double missRate() const {
+        const uint64_t total = this->onTime + this->late + this->shed;
+        return total ? double(this->late + this->shed) / total : 0.0;
+    }
+};
+
+// dispatches deadline tasks to an EDF pool and keeps track of how many of
+// them missed their deadline. With shedding enabled, tasks whose deadline
+// already passed when they come up are dropped instead of executed, which
+// keeps an overloaded pool from working on results nobody waits for
+// anymore. The scheduler has to outlive its tasks
+template <typename _Pool> class DeadlineScheduler final {
+  public:
+    struct Options {
+        bool shedExpired = false;
+        // called with the deadline of every shed task, on the worker
+        std::function<void(Deadline)> onDrop;
+    };
+
+    explicit DeadlineScheduler(_Pool& pool) : DeadlineScheduler(pool, {}) {}
+    DeadlineScheduler(_Pool& pool, Options options)
+        : m_Pool(pool), m_Options(std::move(options)) {}
+
+    // like pool.dispatchWork(deadline, function, args...), shed tasks leave
+    // DeadlineMissed in their future
+    template <typename _Function, typename... _Args>
+    auto dispatch(Deadline deadline, _Function&& function, _Args&&... args) {
+        using _Result = decltype(function(args...));
+        return this->m_Pool.dispatchWork(
+            deadline,
+            [this, deadline, function = std::forward<_Function>(function),
+             args = std::make_tuple(
+                 std::forward<_Args>(args)...)]() mutable -> _Result {
+                if (this->m_Options.shedExpired &&
+                    Deadline::clock::now() > deadline) {
+                    this->m_Shed.fetch_add(1, std::memory_order_relaxed);
+                    if (this->m_Options.onDrop)
+                        this->m_Options.onDrop(deadline);
+                    if constexpr (std::is_void_v<_Result>)
+                        return;
+                    else
+                        throw DeadlineMissed();
+                }
+                // counted once the function returned (or threw)
+                const _Finish finish{*this, deadline};
+                return std::apply(function, args);
+            });
+    }
+    template <typename _Rep, typename _Period, typename _Function,
+              typename... _Args>
+    auto dispatchWithin(const std::chrono::duration<_Rep, _Period>& budget,
+                        _Function&& function, _Args&&... args) {
+        return this->dispatch(
+            Deadline::clock::now() +
+                std::chrono::ceil<Deadline::duration>(budget),
+            std::forward<_Function>(function), std::forward<_Args>(args)...);
+    }
+
+    DeadlineStats stats() const {
+        DeadlineStats stats;
+        stats.onTime = this->m_OnTime.load(std::memory_order_relaxed);
+        stats.late = this->m_Late.load(std::memory_order_relaxed);
+        stats.shed = this->m_Shed.load(std::memory_order_relaxed);
+        return stats;
+    }
+
+  private:
+    struct _Finish {
+        ~_Finish() {
+            auto& counter = Deadline::clock::now() > this->deadline
+                                ? this->scheduler.m_Late
+                                : this->scheduler.m_OnTime;
+            counter.fetch_add(1, std::memory_order_relaxed);
+        }
+
+        DeadlineScheduler& scheduler;
+        Deadline deadline;
+    };
+
+    _Pool& m_Pool;
+    const Options m_Options;
+    std::atomic<uint64_t> m_OnTime = 0, m_Late = 0, m_Shed = 0;
+};
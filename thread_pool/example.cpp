@@ -1,4 +1,9 @@
+#include "coroutine.hpp"
+#include "taskgraph.hpp"
+#include "taskgroup.hpp"
 #include "threadpool.hpp"
+#include <filesystem>
+#include <fstream>
 #include <iostream>
 
 static void exampleWithoutPriority() {
@@ -56,12 +61,407 @@ static void exampleWithPriority() {
     future0.wait();
     future1.wait();
 
-    // note: the threadpools destrutor ignores all currently dispatched tasks
-    // which aren't running, however it will finish the currently running tasks
+    // note: the threadpools destructor finishes the currently running tasks
+    // but drops the dispatched tasks which aren't running yet (their futures
+    // report a broken promise). pool.drain() runs all of them first,
+    // pool.shutdownNow() hands the dropped tasks back
+}
+
+static void exampleCapacity() {
+    using namespace std::chrono_literals;
+    // the only worker is held by a task until opened, so what is
+    // dispatched meanwhile stays queued
+    std::atomic<bool> started = false, opened = false;
+    const auto hold = [&] {
+        started = true;
+        while (!opened)
+            std::this_thread::sleep_for(1ms);
+    };
+
+    ThreadPoolOptions options;
+    options.numThreads = 1;
+    options.capacity = 2;
+    options.overflow = OverflowPolicy::Reject;
+    options.highWatermark = 2;
+    options.lowWatermark = 0;
+    std::atomic<int> high = 0, low = 0;
+    options.onHighWatermark = [&high] { ++high; };
+    options.onLowWatermark = [&low] { ++low; };
+    {
+        ThreadPool pool(options);
+        pool.dispatchWork(hold);
+        while (!started)
+            std::this_thread::yield();
+        pool.dispatchWork([] {});
+        pool.dispatchWork([] {});
+        bool rejected = false;
+        try {
+            pool.dispatchWork([] {});
+        } catch (const std::runtime_error&) {
+            rejected = true;
+        }
+        // tryDispatchWork fails whatever the policy is
+        const bool tried = pool.tryDispatchWork([] {});
+        const bool triedFuture = pool.tryDispatchWork([] { return 0; })
+                                     .has_value();
+        opened = true;
+        pool.drain();
+        std::cout << "full queue: rejected " << rejected << ", tried "
+                  << tried << triedFuture << ", watermarks " << high << low
+                  << std::endl;
+    }
+
+    // with CallerRuns the producer runs what doesn't fit
+    started = opened = false;
+    options.capacity = 1;
+    options.overflow = OverflowPolicy::CallerRuns;
+    options.highWatermark = 0;
+    {
+        ThreadPool pool(options);
+        pool.dispatchWork(hold);
+        while (!started)
+            std::this_thread::yield();
+        pool.dispatchWork([] {});
+        auto future =
+            pool.dispatchWork([] { return std::this_thread::get_id(); });
+        const bool callerRan = future.get() == std::this_thread::get_id();
+        opened = true;
+        pool.drain();
+        std::cout << "full queue ran by the caller: " << callerRan
+                  << std::endl;
+    }
+
+    // with Block the producer waits for room, a shutdown releases it with
+    // the rejection instead of leaving it blocked
+    started = opened = false;
+    options.overflow = OverflowPolicy::Block;
+    {
+        ThreadPool pool(options);
+        pool.dispatchWork(hold);
+        while (!started)
+            std::this_thread::yield();
+        auto queued = pool.dispatchWork([] { return 0; });
+        bool released = false;
+        std::thread producer([&] {
+            try {
+                pool.dispatchWork([] {});
+            } catch (const std::runtime_error&) {
+                released = true;
+            }
+            opened = true;
+        });
+        std::this_thread::sleep_for(10ms);
+        pool.shutdownNow();
+        producer.join();
+        bool broken = false;
+        try {
+            queued.get();
+        } catch (const std::future_error&) {
+            broken = true;
+        }
+        std::cout << "blocked producer released by shutdownNow: " << released
+                  << ", queued task dropped: " << broken << std::endl;
+    }
+}
+
+static size_t fibonacci(ThreadPool<>& pool, size_t n) {
+    if (n < 2)
+        return n;
+    auto future = pool.dispatchWork(fibonacci, std::ref(pool), n - 1);
+    const size_t result = fibonacci(pool, n - 2);
+
+    // a plain future.wait() would block the only worker forever, waiting
+    // through the pool runs the queued sub task on this thread instead
+    pool.wait(future);
+    return result + future.get();
+}
+static void exampleHelpingWait() {
+    ThreadPool pool(1);
+    auto future = pool.dispatchWork(fibonacci, std::ref(pool), 20);
+    pool.wait(future);
+    std::cout << "fibonacci(20) = " << future.get() << std::endl;
+}
+
+static void exampleTaskGraph() {
+    ThreadPool pool;
+    std::atomic<int> a = 0, b = 0, sum = 0;
+
+    // a and b run in parallel, sum waits for both of them
+    TaskGraph graph;
+    const auto nodeA = graph.addNode([&] { a = 1; });
+    const auto nodeB = graph.addNode([&] { b = 2; });
+    const auto nodeSum = graph.addNode([&] { sum += a + b; });
+    graph.addEdge(nodeA, nodeSum);
+    graph.addEdge(nodeB, nodeSum);
+
+    // the graph is reusable, every run reuses the same nodes
+    for (int i = 0; i < 3; ++i)
+        pool.wait(graph.run(pool));
+    std::cout << "task graph sum: " << sum << std::endl;
+}
+
+static void exampleContinuations() {
+    ThreadPool pool;
+
+    // continuations are dispatched to the pool once their input is ready,
+    // no thread waits in between
+    auto future = pool.dispatchWork([] { return 20; })
+                      .then([](Future<int> f) { return f.get() + 1; })
+                      .then([](Future<int> f) { return f.get() * 2; });
+
+    std::vector<Future<int>> futures;
+    futures.push_back(std::move(future));
+    futures.push_back(pool.dispatchWork([] { return 0; }));
+    auto all = when_all(std::move(futures)).then([](auto f) {
+        int sum = 0;
+        for (auto& e : f.get())
+            sum += e.get();
+        return sum;
+    });
+    std::cout << "continuation result: " << all.get() << std::endl;
+}
+
+static void exampleTimers() {
+    using namespace std::chrono_literals;
+    std::atomic<int> ticks = 0;
+    ThreadPool pool(2);
+
+    // timers discard results, a promise hands them back
+    Promise<int> promise;
+    auto fired = promise.getFuture();
+    pool.dispatchAfter(10ms, [promise = std::move(promise)]() mutable {
+        promise.setValue(1);
+    });
+    Promise<int> atPromise;
+    auto firedAt = atPromise.getFuture();
+    pool.dispatchAt(std::chrono::steady_clock::now() + 20ms,
+                    [promise = std::move(atPromise)]() mutable {
+                        promise.setValue(2);
+                    });
+    std::cout << "timers fired: " << fired.get() << ", " << firedAt.get()
+              << std::endl;
+
+    // a cancelled timer doesn't fire, cancelling twice fails
+    std::atomic<bool> cancelledRan = false;
+    auto cancelled =
+        pool.dispatchAfter(50ms, [&cancelledRan] { cancelledRan = true; });
+    const bool first = cancelled.cancel(), second = cancelled.cancel();
+
+    auto every = pool.dispatchEvery(5ms, [&ticks] { ++ticks; });
+    while (ticks < 3)
+        std::this_thread::sleep_for(1ms);
+    every.cancel();
+    pool.drain();
+    const int ticked = ticks;
+    std::this_thread::sleep_for(60ms);
+    std::cout << "cancelled: " << first << second << ", ran " << cancelledRan
+              << ", periodic timer stopped: " << (ticks == ticked)
+              << std::endl;
+
+    // pending timers are dropped with the pool, the promise breaks
+    Promise<int> dropped;
+    auto never = dropped.getFuture();
+    pool.dispatchAfter(1h, [promise = std::move(dropped)]() mutable {
+        promise.setValue(0);
+    });
+    pool.shutdownNow();
+    try {
+        never.get();
+    } catch (const std::future_error&) {
+        std::cout << "pending timer dropped at shutdown" << std::endl;
+    }
+}
+
+static void exampleCancellation() {
+    using namespace std::chrono_literals;
+    ThreadPool pool(1);
+
+    // tasks sharing a stop source are cancelled at once, the ones which
+    // didn't start yet are skipped
+    std::stop_source source;
+    std::atomic<bool> started = false;
+    auto running = pool.dispatchCancellable(
+        source.get_token(), [&started](std::stop_token token) {
+            started = true;
+            while (!token.stop_requested())
+                std::this_thread::sleep_for(1ms);
+            return true;
+        });
+    auto skipped =
+        pool.dispatchCancellable(source.get_token(), [] { return 0; });
+    while (!started)
+        std::this_thread::yield();
+    source.request_stop();
+    bool cancelled = false;
+    try {
+        skipped.get();
+    } catch (const TaskCancelled&) {
+        cancelled = true;
+    }
+    std::cout << "running task saw the stop: " << running.get()
+              << ", queued task cancelled: " << cancelled << std::endl;
+
+    // dropped by a shutdown a task isn't cancelled, its promise breaks
+    std::stop_source other;
+    pool.dispatchWork([] { std::this_thread::sleep_for(20ms); });
+    auto dropped =
+        pool.dispatchCancellable(other.get_token(), [] { return 0; });
+    pool.shutdownNow();
+    try {
+        dropped.get();
+    } catch (const std::future_error&) {
+        std::cout << "cancellable task dropped at shutdown" << std::endl;
+    }
+}
+
+static void exampleTaskGroup() {
+    using namespace std::chrono_literals;
+    ThreadPool pool(2);
+    std::atomic<int> sum = 0;
+    {
+        // tasks may run more tasks of their group, wait() covers them too
+        TaskGroup tasks(pool);
+        for (int i = 1; i <= 10; ++i)
+            tasks.run([&tasks, &sum, i] {
+                sum += i;
+                tasks.run([&sum] { sum += 100; });
+            });
+        tasks.wait();
+    }
+    std::cout << "task group sum: " << sum << std::endl;
+
+    // tasks dropped by a pool shutting down count as skipped, waiting for
+    // the group returns instead of hanging
+    ThreadPool stopping(1);
+    std::atomic<int> ran = 0;
+    TaskGroup tasks(stopping);
+    stopping.dispatchWork([] { std::this_thread::sleep_for(50ms); });
+    for (int i = 0; i < 10; ++i)
+        tasks.run([&ran] { ++ran; });
+    stopping.shutdownNow();
+    tasks.wait();
+    std::cout << "task group after shutdown: " << ran << " of 10 ran"
+              << std::endl;
+}
+
+static Task<int> coroutineLeaf(ThreadPool<>& pool, int value) {
+    // suspends and continues on a worker, no thread blocks
+    co_await pool.schedule();
+    co_return value;
+}
+static Task<int> coroutineSum(ThreadPool<>& pool) {
+    int sum = co_await coroutineLeaf(pool, 1);
+    sum += co_await pool.dispatchWork([] { return 2; });
+    co_return sum;
+}
+static void exampleCoroutines() {
+    ThreadPool pool(2);
+    std::vector<Future<int>> futures;
+    for (int i = 0; i < 1000; ++i)
+        futures.push_back(spawn(pool, coroutineSum(pool)));
+    int total = 0;
+    for (auto& e : futures)
+        total += e.get();
+    std::cout << "1000 coroutines on 2 workers: " << total << std::endl;
+}
+
+static void exampleResize() {
+    ThreadPoolOptions options;
+    options.numThreads = 1;
+    options.maxThreads = 4;
+    ThreadPool pool(options);
+
+    // queued work survives resizing, retiring workers hand it over
+    std::atomic<int> done = 0;
+    for (int i = 0; i < 100; ++i)
+        pool.dispatchWork([&done] { ++done; });
+    pool.resize(4);
+    pool.resize(2);
+    pool.wait(pool.dispatchWork([] { return 0; }));
+    while (done < 100)
+        std::this_thread::yield();
+    std::cout << "resized to " << pool.numThreads() << " threads, " << done
+              << " tasks done" << std::endl;
+}
+
+static void exampleTopology() {
+    using threadpool_detail::numaNodes;
+    using threadpool_detail::parseCpuList;
+    const bool parsed = parseCpuList("0-2,5,7-8\n") ==
+                            std::vector<size_t>{0, 1, 2, 5, 7, 8} &&
+                        parseCpuList("").empty();
+
+    // numaNodes reads any directory laid out like /sys/devices/system/node,
+    // a fake one checks the parsing: nodes are ordered by id, entries which
+    // aren't nodes and nodes without cpus are skipped
+    const auto root =
+        std::filesystem::temp_directory_path() / "threadpool_topology";
+    std::filesystem::remove_all(root);
+    const auto write = [&root](const std::string& dir, const char* cpus) {
+        std::filesystem::create_directories(root / dir);
+        std::ofstream(root / dir / "cpulist") << cpus;
+    };
+    write("node10", "12-13\n");
+    write("node1", "4-7\n");
+    write("node0", "0-3,8\n");
+    write("node2", "\n");
+    write("nodes", "9\n");
+    std::ofstream(root / "possible") << "0-10\n";
+    const bool fake = numaNodes(root) == std::vector<std::vector<size_t>>{
+                                             {0, 1, 2, 3, 8},
+                                             {4, 5, 6, 7},
+                                             {12, 13}};
+    // without any node everything is one node of the allowed cpus
+    const bool fallback =
+        numaNodes(root / "missing") ==
+        std::vector<std::vector<size_t>>{threadpool_detail::allowedCpus()};
+    std::filesystem::remove_all(root);
+    std::cout << "cpu lists parsed: " << parsed << ", fake nodes: " << fake
+              << ", fallback: " << fallback << std::endl;
+
+    // pinned workers keep to the cpu set
+    ThreadPoolOptions options;
+    options.numThreads = 2;
+    options.cpuSet = {threadpool_detail::allowedCpus().front()};
+    options.pinWorkers = true;
+    ThreadPool pool(options);
+    auto cpu =
+        pool.dispatchWork([] { return threadpool_detail::currentCpu(); });
+    std::cout << "pinned to cpu " << options.cpuSet.front() << ", ran on "
+              << cpu.get() << std::endl;
+}
+
+// build with THREADPOOL_TRACING and open the file in ui.perfetto.dev
+static void exampleTrace() {
+#if THREADPOOL_TRACING
+    ThreadPool pool(4);
+    {
+        TraceName name("fan out");
+        for (int i = 0; i < 64; ++i)
+            pool.dispatchWork(i % 4, [] {
+                std::this_thread::sleep_for(std::chrono::microseconds(100));
+            });
+    }
+    pool.drain();
+    std::ofstream file("threadpool_trace.json");
+    pool.writeChromeTrace(file);
+    std::cout << "trace written to threadpool_trace.json" << std::endl;
+#endif
 }
 
 int main() {
     exampleWithoutPriority();
     exampleWithPriority();
+    exampleCapacity();
+    exampleHelpingWait();
+    exampleTaskGraph();
+    exampleContinuations();
+    exampleTimers();
+    exampleCancellation();
+    exampleTaskGroup();
+    exampleCoroutines();
+    exampleResize();
+    exampleTopology();
+    exampleTrace();
     return 0;
 }
@@ -0,0 +1,585 @@
+#pragma once
+#include "uniquefunction.hpp"
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <coroutine>
+#include <exception>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <tuple>
+#include <type_traits>
+#include <stdexcept>
+#include <utility>
+#include <vector>
+
+// type erased reference to a pool, or anything else with a
+// post(UniqueFunction<void()>) member, continuations are posted to it
+class Executor final {
+  public:
+    Executor() = default;
+    template <typename _Pool,
+              typename = std::enable_if_t<
+                  !std::is_same_v<std::decay_t<_Pool>, Executor>>>
+    Executor(_Pool& pool)
+        : m_Context(&pool),
+          m_Post([](void* context, UniqueFunction<void()>&& task) {
+              static_cast<_Pool*>(context)->post(std::move(task));
+          }) {}
+
+    explicit operator bool() const { return this->m_Post; }
+    void post(UniqueFunction<void()>&& task) const {
+        this->m_Post(this->m_Context, std::move(task));
+    }
+
+  private:
+    void* m_Context = nullptr;
+    void (*m_Post)(void*, UniqueFunction<void()>&&) = nullptr;
+};
+
+namespace threadpool_detail {
+
+// thread local free lists of equally sized blocks, shared states are
+// recycled instead of going through the global allocator for every task.
+// Overflowing lists hand whole batches to a shared depot, so blocks freed by
+// workers flow back to the producing threads
+template <size_t _Size> struct BlockPool final {
+    static void* allocate() {
+        auto& list = s_FreeList;
+        if (!list.head && !_depot().take(list))
+            return ::operator new(_Size);
+        auto* block = list.head;
+        list.head = block->next;
+        --list.count;
+        return block;
+    }
+    static void deallocate(void* ptr) noexcept {
+        auto& list = s_FreeList;
+        if (list.count >= s_MaxCached &&
+            (list.destroyed || !_depot().give(list))) {
+            ::operator delete(ptr);
+            return;
+        }
+        list.head = ::new (ptr) _Block{list.head};
+        ++list.count;
+    }
+
+  private:
+    static constexpr size_t s_BatchSize = 256;
+    static constexpr size_t s_MaxCached = 2 * s_BatchSize;
+    static constexpr size_t s_MaxBatches = 256;
+
+    struct _Block {
+        _Block* next;
+    };
+    struct _FreeList {
+        ~_FreeList() {
+            _free(std::exchange(this->head, nullptr));
+            // blocks released after this point bypass the list
+            this->count = s_MaxCached;
+            this->destroyed = true;
+        }
+        _Block* head = nullptr;
+        size_t count = 0;
+        bool destroyed = false;
+    };
+    struct _Depot {
+        // moves one batch into the empty list
+        bool take(_FreeList& list) {
+            std::lock_guard lock(this->mutex);
+            if (this->batches.empty())
+                return false;
+            list.head = this->batches.back();
+            list.count = s_BatchSize;
+            this->batches.pop_back();
+            return true;
+        }
+        // moves one batch out of the full list
+        bool give(_FreeList& list) noexcept {
+            std::lock_guard lock(this->mutex);
+            if (this->batches.size() >= s_MaxBatches)
+                return false;
+            this->batches.push_back(list.head);
+            auto* last = list.head;
+            for (size_t i = 1; i < s_BatchSize; ++i)
+                last = last->next;
+            list.head = std::exchange(last->next, nullptr);
+            list.count -= s_BatchSize;
+            return true;
+        }
+
+        std::mutex mutex;
+        std::vector<_Block*> batches = _reserved();
+    };
+    static std::vector<_Block*> _reserved() {
+        std::vector<_Block*> result;
+        result.reserve(s_MaxBatches);
+        return result;
+    }
+    static void _free(_Block* head) {
+        while (head)
+            ::operator delete(std::exchange(head, head->next));
+    }
+
+    // intentionally leaked, states may be released during static destruction
+    static _Depot& _depot() {
+        static auto* depot = new _Depot();
+        return *depot;
+    }
+
+    static inline thread_local _FreeList s_FreeList;
+};
+template <typename _Type> struct PooledObject {
+    static void* operator new(size_t) {
+        return BlockPool<_roundedSize()>::allocate();
+    }
+    static void operator delete(void* ptr) noexcept {
+        BlockPool<_roundedSize()>::deallocate(ptr);
+    }
+
+  private:
+    // round to cache lines, so states of different types share pools
+    static constexpr size_t _roundedSize() {
+        return (sizeof(_Type) + 63) / 64 * 64;
+    }
+};
+
+struct SharedStateBase {
+    void wait() {
+        if (this->isReady())
+            return;
+        std::unique_lock lock(this->mutex);
+        ++this->waiters;
+        this->conditionVariable.wait(lock, [this] { return this->isReady(); });
+        --this->waiters;
+    }
+    template <typename _Clock, typename _Duration>
+    std::future_status
+        waitUntil(const std::chrono::time_point<_Clock, _Duration>& time) {
+        if (this->isReady())
+            return std::future_status::ready;
+        std::unique_lock lock(this->mutex);
+        ++this->waiters;
+        const bool ready = this->conditionVariable.wait_until(
+            lock, time, [this] { return this->isReady(); });
+        --this->waiters;
+        return ready ? std::future_status::ready
+                     : std::future_status::timeout;
+    }
+    bool isReady() const {
+        return this->ready.load(std::memory_order_acquire);
+    }
+    void setException(std::exception_ptr exceptionPtr) {
+        this->_checkUnsatisfied();
+        this->exception = std::move(exceptionPtr);
+        this->markReady();
+    }
+    void markReady() {
+        std::unique_lock lock(this->mutex);
+        this->ready.store(true, std::memory_order_release);
+        auto foo = std::move(this->callback);
+        const bool notify = this->waiters;
+        lock.unlock();
+        if (notify)
+            this->conditionVariable.notify_all();
+        if (foo)
+            foo();
+    }
+    // foo runs on the thread making the state ready, or right away if it
+    // already is. Multiple callbacks run in the order they were added
+    void onReady(UniqueFunction<void()>&& foo) {
+        std::unique_lock lock(this->mutex);
+        if (this->isReady()) {
+            lock.unlock();
+            foo();
+        } else if (this->callback)
+            this->callback = [first = std::move(this->callback),
+                              second = std::move(foo)]() mutable {
+                first();
+                second();
+            };
+        else
+            this->callback = std::move(foo);
+    }
+    void rethrowIfFailed() {
+        if (this->exception)
+            std::rethrow_exception(this->exception);
+    }
+    // returns true if the caller dropped the last reference
+    bool release() {
+        return this->references.fetch_sub(1, std::memory_order_acq_rel) == 1;
+    }
+
+    std::exception_ptr exception;
+    std::atomic<bool> ready = false;
+    std::atomic<unsigned> references = 2; // promise and future
+
+    std::mutex mutex;
+    unsigned waiters = 0;
+    std::condition_variable conditionVariable;
+    UniqueFunction<void()> callback;
+    Executor executor;
+
+  protected:
+    void _checkUnsatisfied() const {
+        if (this->isReady())
+            throw std::future_error(
+                std::future_errc::promise_already_satisfied);
+    }
+};
+
+template <typename _Type> struct SharedState final
+    : SharedStateBase, PooledObject<SharedState<_Type>> {
+    using _Stored = std::conditional_t<std::is_reference_v<_Type>,
+                                       std::remove_reference_t<_Type>*, _Type>;
+
+    ~SharedState() {
+        if (this->isReady() && !this->exception)
+            this->_value()->~_Stored();
+    }
+    template <typename... _Args> void setValue(_Args&&... args) {
+        this->_checkUnsatisfied();
+        ::new (static_cast<void*>(this->storage))
+            _Stored(std::forward<_Args>(args)...);
+        this->markReady();
+    }
+    _Type take() {
+        this->rethrowIfFailed();
+        if constexpr (std::is_reference_v<_Type>)
+            return **this->_value();
+        else
+            return std::move(*this->_value());
+    }
+
+    alignas(_Stored) unsigned char storage[sizeof(_Stored)];
+
+  private:
+    _Stored* _value() {
+        return std::launder(reinterpret_cast<_Stored*>(this->storage));
+    }
+};
+template <> struct SharedState<void> final
+    : SharedStateBase, PooledObject<SharedState<void>> {
+    void setValue() {
+        this->_checkUnsatisfied();
+        this->markReady();
+    }
+    void take() { this->rethrowIfFailed(); }
+};
+
+template <typename _Type> struct StateHandle {
+    StateHandle() = default;
+    explicit StateHandle(SharedState<_Type>* state) : m_State(state) {}
+    StateHandle(StateHandle&& rhs) noexcept
+        : m_State(std::exchange(rhs.m_State, nullptr)) {}
+    StateHandle& operator=(StateHandle&& rhs) noexcept {
+        if (this != &rhs) {
+            this->_release();
+            this->m_State = std::exchange(rhs.m_State, nullptr);
+        }
+        return *this;
+    }
+    ~StateHandle() { this->_release(); }
+
+  protected:
+    void _checkValid() const {
+        if (!this->m_State)
+            throw std::future_error(std::future_errc::no_state);
+    }
+    void _release() {
+        if (this->m_State && this->m_State->release())
+            delete this->m_State;
+        this->m_State = nullptr;
+    }
+
+    SharedState<_Type>* m_State = nullptr;
+};
+
+struct Combinators;
+
+} // namespace threadpool_detail
+
+template <typename _Type> class Future;
+template <typename _Type> class Promise;
+template <typename _Type> struct WhenAnyResult {
+    size_t index;
+    std::vector<Future<_Type>> futures;
+};
+
+// counterpart of std::future, its shared state is recycled through thread
+// local pools instead of being allocated for every task
+template <typename _Type>
+class Future final : threadpool_detail::StateHandle<_Type> {
+  public:
+    Future() = default;
+
+    bool valid() const { return this->m_State; }
+    bool isReady() const {
+        this->_checkValid();
+        return this->m_State->isReady();
+    }
+
+    _Type get() {
+        this->wait();
+        Future future = std::move(*this);
+        return future.m_State->take();
+    }
+    void wait() const {
+        this->_checkValid();
+        this->m_State->wait();
+    }
+    template <typename _Rep, typename _Period>
+    std::future_status
+        wait_for(const std::chrono::duration<_Rep, _Period>& duration) const {
+        return this->wait_until(std::chrono::steady_clock::now() + duration);
+    }
+    template <typename _Clock, typename _Duration>
+    std::future_status wait_until(
+        const std::chrono::time_point<_Clock, _Duration>& time) const {
+        this->_checkValid();
+        return this->m_State->waitUntil(time);
+    }
+
+    // once this future is ready foo(readyFuture) is posted to the executor
+    // of the pool which produced it (or run inline without one), nothing
+    // blocks in the meantime. The future gets invalidated
+    template <typename _Function> auto then(_Function&& foo) {
+        this->_checkValid();
+        return this->then(this->m_State->executor,
+                          std::forward<_Function>(foo));
+    }
+    template <typename _Function>
+    auto then(Executor executor, _Function&& foo)
+        -> Future<std::invoke_result_t<std::decay_t<_Function>&, Future>> {
+        using _Result = std::invoke_result_t<std::decay_t<_Function>&, Future>;
+        this->_checkValid();
+        Promise<_Result> promise;
+        promise.setExecutor(executor);
+        auto result = promise.getFuture();
+
+        auto* state = this->m_State;
+        state->onReady([executor, promise = std::move(promise),
+                        foo = std::forward<_Function>(foo),
+                        self = std::move(*this)]() mutable {
+            auto continuation = [promise = std::move(promise),
+                                 foo = std::move(foo),
+                                 self = std::move(self)]() mutable {
+                promise.setValueFrom([&] { return foo(std::move(self)); });
+            };
+            if (executor)
+                executor.post(std::move(continuation));
+            else
+                continuation();
+        });
+        return result;
+    }
+
+  private:
+    friend struct threadpool_detail::Combinators;
+    template <typename> friend class Promise;
+    explicit Future(threadpool_detail::SharedState<_Type>* state)
+        : threadpool_detail::StateHandle<_Type>(state) {}
+};
+
+// counterpart of std::promise, an unsatisfied promise stores a broken_promise
+// future_error on destruction, so a waiting future never hangs
+template <typename _Type>
+class Promise final : threadpool_detail::StateHandle<_Type> {
+  public:
+    Promise()
+        : threadpool_detail::StateHandle<_Type>(
+              new threadpool_detail::SharedState<_Type>()) {}
+    Promise(Promise&&) noexcept = default;
+    Promise& operator=(Promise&& rhs) noexcept {
+        if (this != &rhs) {
+            this->_abandon();
+            threadpool_detail::StateHandle<_Type>::operator=(std::move(rhs));
+            this->m_FutureRetrieved = rhs.m_FutureRetrieved;
+        }
+        return *this;
+    }
+    ~Promise() { this->_abandon(); }
+
+    Future<_Type> getFuture() {
+        this->_checkValid();
+        if (this->m_FutureRetrieved)
+            throw std::future_error(
+                std::future_errc::future_already_retrieved);
+        this->m_FutureRetrieved = true;
+        return Future<_Type>(this->m_State);
+    }
+
+    template <typename... _Args> void setValue(_Args&&... args) {
+        this->_checkValid();
+        if constexpr (std::is_reference_v<_Type>)
+            this->m_State->setValue(std::addressof(args)...);
+        else
+            this->m_State->setValue(std::forward<_Args>(args)...);
+    }
+    void setException(std::exception_ptr exceptionPtr) {
+        this->_checkValid();
+        this->m_State->setException(std::move(exceptionPtr));
+    }
+    // continuations of the future run on this executor
+    void setExecutor(Executor executor) {
+        this->_checkValid();
+        this->m_State->executor = executor;
+    }
+
+    // stores the result of foo() or the exception it throws
+    template <typename _Function> void setValueFrom(_Function&& foo) {
+        try {
+            if constexpr (std::is_void_v<_Type>) {
+                std::forward<_Function>(foo)();
+                this->setValue();
+            } else
+                this->setValue(std::forward<_Function>(foo)());
+        } catch (...) {
+            this->setException(std::current_exception());
+        }
+    }
+
+  private:
+    void _abandon() {
+        if (!this->m_State)
+            return;
+        if (!this->m_State->isReady())
+            this->m_State->setException(std::make_exception_ptr(
+                std::future_error(std::future_errc::broken_promise)));
+        // the shared state expects a future, without one drop its reference
+        if (!std::exchange(this->m_FutureRetrieved, true))
+            this->m_State->release();
+    }
+
+    bool m_FutureRetrieved = false;
+};
+
+namespace threadpool_detail {
+
+struct Combinators {
+    template <typename _Type>
+    static void onReady(Future<_Type>& future, UniqueFunction<void()>&& foo) {
+        future._checkValid();
+        future.m_State->onReady(std::move(foo));
+    }
+    template <typename _Type>
+    static Executor executor(const Future<_Type>& future) {
+        return future.m_State ? future.m_State->executor : Executor();
+    }
+};
+
+// task which resumes a suspended coroutine. Dropped without running (the
+// pool shut down) it destroys the coroutine instead, freeing its frame and
+// breaking the promises the frame owns
+class Resumer final {
+  public:
+    explicit Resumer(std::coroutine_handle<> handle) : m_Handle(handle) {}
+    Resumer(Resumer&& rhs) noexcept
+        : m_Handle(std::exchange(rhs.m_Handle, nullptr)) {}
+    Resumer& operator=(Resumer&&) = delete;
+    ~Resumer() {
+        if (this->m_Handle)
+            this->m_Handle.destroy();
+    }
+
+    void operator()() { std::exchange(this->m_Handle, nullptr).resume(); }
+
+  private:
+    std::coroutine_handle<> m_Handle;
+};
+
+} // namespace threadpool_detail
+
+// ready once all futures are ready, holds the (ready) input futures
+template <typename _Type>
+Future<std::vector<Future<_Type>>>
+    when_all(std::vector<Future<_Type>> futures) {
+    using threadpool_detail::Combinators;
+    struct _State {
+        std::vector<Future<_Type>> futures;
+        std::atomic<size_t> remaining;
+        Promise<std::vector<Future<_Type>>> promise;
+    };
+    auto state = std::make_shared<_State>();
+    state->remaining = futures.size() + 1;
+    if (!futures.empty())
+        state->promise.setExecutor(Combinators::executor(futures.front()));
+    auto result = state->promise.getFuture();
+
+    auto finishOne = [](_State& e) {
+        if (e.remaining.fetch_sub(1, std::memory_order_acq_rel) == 1)
+            e.promise.setValue(std::move(e.futures));
+    };
+    state->futures = std::move(futures);
+    for (auto& e : state->futures)
+        Combinators::onReady(e, [state, finishOne] { finishOne(*state); });
+    // the extra count keeps the vector untouched until every callback is set
+    finishOne(*state);
+    return result;
+}
+template <typename... _Types>
+Future<std::tuple<Future<_Types>...>> when_all(Future<_Types>&&... futures) {
+    using threadpool_detail::Combinators;
+    struct _State {
+        std::tuple<Future<_Types>...> futures;
+        std::atomic<size_t> remaining = sizeof...(_Types) + 1;
+        Promise<std::tuple<Future<_Types>...>> promise;
+    };
+    auto state = std::make_shared<_State>();
+    if constexpr (sizeof...(_Types) > 0)
+        state->promise.setExecutor(Combinators::executor(std::get<0>(
+            std::forward_as_tuple(futures...))));
+    auto result = state->promise.getFuture();
+
+    auto finishOne = [](_State& e) {
+        if (e.remaining.fetch_sub(1, std::memory_order_acq_rel) == 1)
+            e.promise.setValue(std::move(e.futures));
+    };
+    state->futures = std::make_tuple(std::move(futures)...);
+    std::apply(
+        [&](auto&... e) {
+            (Combinators::onReady(e, [state, finishOne] { finishOne(*state); }),
+             ...);
+        },
+        state->futures);
+    finishOne(*state);
+    return result;
+}
+
+// ready once the first future is ready, holds its index and all futures
+template <typename _Type>
+Future<WhenAnyResult<_Type>> when_any(std::vector<Future<_Type>> futures) {
+    using threadpool_detail::Combinators;
+    if (futures.empty())
+        throw std::invalid_argument("when_any: no futures given");
+    // the first ready future wins, but the result is published by whoever
+    // comes second: the winner or the thread still installing callbacks
+    struct _State {
+        WhenAnyResult<_Type> result;
+        std::atomic<size_t> winner = ~size_t(0);
+        std::atomic<size_t> arrived = 0;
+        Promise<WhenAnyResult<_Type>> promise;
+
+        void arrive() {
+            if (this->arrived.fetch_add(1, std::memory_order_acq_rel) != 1)
+                return;
+            this->result.index = this->winner.load();
+            this->promise.setValue(std::move(this->result));
+        }
+    };
+    auto state = std::make_shared<_State>();
+    state->promise.setExecutor(Combinators::executor(futures.front()));
+    auto result = state->promise.getFuture();
+
+    state->result.futures = std::move(futures);
+    for (size_t i = 0; i < state->result.futures.size(); ++i)
+        Combinators::onReady(state->result.futures[i], [state, i] {
+            size_t none = ~size_t(0);
+            if (state->winner.compare_exchange_strong(none, i))
+                state->arrive();
+        });
+    state->arrive();
+    return result;
+}
@@ -0,0 +1,221 @@
+#pragma once
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <bit>
+#include <chrono>
+#include <cstdint>
+#include <mutex>
+#include <vector>
+
+// ThreadPool instrumentation, compiled in with -DTHREADPOOL_METRICS=1.
+// Without it the pool takes no timestamps and keeps no counters, stats()
+// then returns an empty snapshot
+#ifndef THREADPOOL_METRICS
+#define THREADPOOL_METRICS 0
+#endif
+
+// HDR style histogram of durations: 16 linear sub buckets per power of two
+// nanoseconds (about 6% relative error) up to 2^40 ns, longer durations are
+// counted in the last bucket. Recording is a relaxed increment, so a
+// histogram can be read while it is being written
+class LatencyHistogram final {
+  public:
+    LatencyHistogram() = default;
+    LatencyHistogram(const LatencyHistogram& other) { *this += other; }
+    LatencyHistogram& operator=(const LatencyHistogram& other) {
+        for (auto& e : this->m_Buckets)
+            e.store(0, std::memory_order_relaxed);
+        this->m_Sum.store(0, std::memory_order_relaxed);
+        return *this += other;
+    }
+    LatencyHistogram& operator+=(const LatencyHistogram& other) {
+        for (size_t i = 0; i < s_NumBuckets; ++i)
+            this->_add(this->m_Buckets[i], other.m_Buckets[i]);
+        this->_add(this->m_Sum, other.m_Sum);
+        return *this;
+    }
+
+    void record(std::chrono::nanoseconds duration) {
+        const uint64_t ns = uint64_t(std::max<int64_t>(duration.count(), 0));
+        this->m_Buckets[_bucket(ns)].fetch_add(1, std::memory_order_relaxed);
+        this->m_Sum.fetch_add(ns, std::memory_order_relaxed);
+    }
+
+    uint64_t count() const {
+        uint64_t count = 0;
+        for (auto& e : this->m_Buckets)
+            count += e.load(std::memory_order_relaxed);
+        return count;
+    }
+    std::chrono::nanoseconds mean() const {
+        const uint64_t count = this->count();
+        return std::chrono::nanoseconds(
+            count ? this->m_Sum.load(std::memory_order_relaxed) / count : 0);
+    }
+    // upper bound of the bucket holding the given fraction of the values,
+    // percentile(1.0) is the (approximate) maximum
+    std::chrono::nanoseconds percentile(double fraction) const {
+        const uint64_t count = this->count();
+        if (!count)
+            return {};
+        const auto rank = uint64_t(std::clamp(fraction, 0.0, 1.0) * count);
+        uint64_t seen = 0;
+        for (size_t i = 0; i < s_NumBuckets; ++i) {
+            seen += this->m_Buckets[i].load(std::memory_order_relaxed);
+            if (seen >= std::max<uint64_t>(rank, 1))
+                return std::chrono::nanoseconds(_upperBound(i));
+        }
+        return std::chrono::nanoseconds(_upperBound(s_NumBuckets - 1));
+    }
+
+  private:
+    static constexpr unsigned s_SubBits = 4, s_MaxBits = 40;
+    static constexpr uint64_t s_SubBuckets = uint64_t(1) << s_SubBits;
+    static constexpr size_t s_NumBuckets =
+        (s_MaxBits - s_SubBits + 1) * s_SubBuckets;
+
+    static size_t _bucket(uint64_t ns) {
+        if (ns < s_SubBuckets)
+            return size_t(ns);
+        const unsigned exponent = std::bit_width(ns) - 1;
+        if (exponent >= s_MaxBits)
+            return s_NumBuckets - 1;
+        const uint64_t sub =
+            (ns >> (exponent - s_SubBits)) & (s_SubBuckets - 1);
+        return (exponent - s_SubBits + 1) * s_SubBuckets + sub;
+    }
+    static uint64_t _upperBound(size_t bucket) {
+        if (bucket < s_SubBuckets)
+            return bucket;
+        const unsigned shift = unsigned(bucket / s_SubBuckets) - 1;
+        const uint64_t sub = bucket % s_SubBuckets;
+        return ((s_SubBuckets + sub + 1) << shift) - 1;
+    }
+    static void _add(std::atomic<uint64_t>& to,
+                     const std::atomic<uint64_t>& from) {
+        to.fetch_add(from.load(std::memory_order_relaxed),
+                     std::memory_order_relaxed);
+    }
+
+    std::array<std::atomic<uint64_t>, s_NumBuckets> m_Buckets{};
+    std::atomic<uint64_t> m_Sum = 0;
+};
+
+struct WorkerStats {
+    uint64_t tasks = 0;
+    // tasks taken from other workers' queues
+    uint64_t steals = 0;
+    // time spent running tasks and between tasks (looking for work,
+    // spinning, parked)
+    std::chrono::nanoseconds busy{}, idle{};
+};
+
+struct QueueDepthSample {
+    // since the pool was created
+    std::chrono::nanoseconds time;
+    size_t depth;
+};
+
+template <typename _PriorityType> struct ThreadPoolStats {
+    struct Priority {
+        _PriorityType priority;
+        // enqueue to start and start to finish
+        LatencyHistogram wait, run;
+    };
+
+    // one entry per worker slot (see ThreadPoolOptions::maxThreads)
+    std::vector<WorkerStats> workers;
+    // tasks run by threads helping the pool, like ThreadPool::wait
+    WorkerStats external;
+    // queued tasks now and the most seen when a task started
+    size_t queueDepth = 0, maxQueueDepth = 0;
+    // the queue depth every millisecond while tasks start, oldest first
+    std::vector<QueueDepthSample> queueDepthHistory;
+    // priority levels which ran tasks, most important first
+    std::vector<Priority> priorities;
+};
+
+namespace threadpool_detail {
+
+// integral priorities are tracked in this many levels, clamped like in
+// LockFreeQueue, other priority types in a single one
+constexpr size_t s_MetricLevels = 8;
+
+struct WorkerMetrics {
+    using Clock = std::chrono::steady_clock;
+
+    void ran(size_t level, Clock::time_point enqueued,
+             Clock::time_point start, Clock::time_point finish) {
+        this->tasks.fetch_add(1, std::memory_order_relaxed);
+        this->busy.fetch_add((finish - start).count(),
+                             std::memory_order_relaxed);
+        this->wait[level].record(start - enqueued);
+        this->run[level].record(finish - start);
+    }
+    WorkerStats stats() const {
+        WorkerStats stats;
+        stats.tasks = this->tasks.load(std::memory_order_relaxed);
+        stats.steals = this->steals.load(std::memory_order_relaxed);
+        stats.busy =
+            Clock::duration(this->busy.load(std::memory_order_relaxed));
+        stats.idle =
+            Clock::duration(this->idle.load(std::memory_order_relaxed));
+        return stats;
+    }
+
+    std::atomic<uint64_t> tasks = 0, steals = 0;
+    std::atomic<Clock::rep> busy = 0, idle = 0;
+    // only used by the worker itself
+    Clock::time_point lastFinish = Clock::now();
+    std::array<LatencyHistogram, s_MetricLevels> wait, run;
+};
+
+// records the queue depth at most once per interval into a ring of the
+// latest samples, the threads starting tasks take turns
+class DepthSampler final {
+  public:
+    using Clock = std::chrono::steady_clock;
+
+    void sample(Clock::time_point now, size_t depth) {
+        size_t max = this->m_Max.load(std::memory_order_relaxed);
+        while (depth > max &&
+               !this->m_Max.compare_exchange_weak(max, depth,
+                                                  std::memory_order_relaxed))
+            ;
+        const Clock::rep elapsed = (now - this->m_Epoch).count();
+        Clock::rep next = this->m_Next.load(std::memory_order_relaxed);
+        if (elapsed < next ||
+            !this->m_Next.compare_exchange_strong(
+                next, elapsed + s_Interval.count(), std::memory_order_relaxed))
+            return;
+        std::lock_guard lock(this->m_Mutex);
+        if (this->m_Samples.size() < s_MaxSamples)
+            this->m_Samples.push_back({Clock::duration(elapsed), depth});
+        else
+            this->m_Samples[this->m_Oldest++ % s_MaxSamples] = {
+                Clock::duration(elapsed), depth};
+    }
+    size_t max() const { return this->m_Max.load(std::memory_order_relaxed); }
+    std::vector<QueueDepthSample> history() const {
+        std::lock_guard lock(this->m_Mutex);
+        auto samples = this->m_Samples;
+        std::rotate(samples.begin(),
+                    samples.begin() + this->m_Oldest % s_MaxSamples,
+                    samples.end());
+        return samples;
+    }
+
+  private:
+    static constexpr Clock::duration s_Interval = std::chrono::milliseconds(1);
+    static constexpr size_t s_MaxSamples = 4096;
+
+    const Clock::time_point m_Epoch = Clock::now();
+    std::atomic<Clock::rep> m_Next = 0;
+    std::atomic<size_t> m_Max = 0;
+    mutable std::mutex m_Mutex;
+    std::vector<QueueDepthSample> m_Samples;
+    size_t m_Oldest = 0;
+};
+
+} // namespace threadpool_detail
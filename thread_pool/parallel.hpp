@@ -0,0 +1,193 @@
+#pragma once
+#include "threadpool.hpp"
+#include <algorithm>
+#include <atomic>
+#include <exception>
+#include <memory>
+#include <mutex>
+#include <functional>
+#include <optional>
+#include <thread>
+#include <type_traits>
+
+namespace threadpool_detail {
+
+// indices are passed as they are, iterators are dereferenced
+template <typename _Index> decltype(auto) element(const _Index& index) {
+    if constexpr (std::is_integral_v<_Index>)
+        return _Index(index);
+    else
+        return *index;
+}
+
+// hands out chunks of [0, size) with guided self scheduling: every claim
+// takes a share of the remaining range, so chunks start big and shrink down
+// to the grain size towards the end, which balances uneven workloads
+struct ParallelScheduler {
+    ParallelScheduler(size_t numItems, size_t grain, size_t numParticipants)
+        : size(numItems), grainSize(grain), participants(numParticipants) {}
+
+    bool claim(size_t& begin, size_t& end) {
+        size_t current = this->next.load(std::memory_order_relaxed);
+        while (current < this->size) {
+            const size_t remaining = this->size - current;
+            const size_t chunk =
+                std::min(remaining, std::max(this->grainSize,
+                                             remaining / (2 * participants)));
+            if (this->next.compare_exchange_weak(current, current + chunk)) {
+                begin = current;
+                end = current + chunk;
+                return true;
+            }
+        }
+        return false;
+    }
+    // after the first failure the remaining chunks are claimed but skipped
+    template <typename _Function> void execute(_Function&& foo) {
+        if (this->failed.load(std::memory_order_relaxed))
+            return;
+        try {
+            foo();
+        } catch (...) {
+            if (!this->failed.exchange(true))
+                this->exception = std::current_exception();
+        }
+    }
+    void finish(size_t numItems) {
+        this->done.fetch_add(numItems, std::memory_order_release);
+    }
+
+    const size_t size, grainSize, participants;
+    std::atomic<size_t> next = 0;
+    std::atomic<size_t> done = 0;
+    // helpers currently inside the participant function
+    std::atomic<size_t> active = 0;
+    std::atomic<bool> failed = false;
+    std::exception_ptr exception;
+};
+
+// runs participant(scheduler) on the calling thread and on up to one helper
+// task per worker, returns once every item is finished. Helpers which start
+// late find the range exhausted and return without touching the caller's
+// stack
+template <typename _Pool, typename _Participant>
+void runParallel(_Pool& pool, size_t size, size_t grainSize,
+                 _Participant& participant) {
+    if (size == 0)
+        return;
+    const size_t numThreads = std::max<size_t>(pool.numThreads(), 1);
+    // auto grain: roughly 16 chunks per thread at the tail end
+    if (grainSize == 0)
+        grainSize = std::max<size_t>(1, size / (16 * numThreads));
+    const size_t numHelpers =
+        std::min(numThreads, (size + grainSize - 1) / grainSize - 1);
+
+    auto scheduler = std::make_shared<ParallelScheduler>(size, grainSize,
+                                                         numHelpers + 1);
+    if (numHelpers) {
+        std::vector<size_t> helpers(numHelpers);
+        pool.dispatchBulk(
+            helpers.begin(), helpers.end(),
+            [scheduler, participant = &participant](size_t) {
+                scheduler->active.fetch_add(1);
+                if (scheduler->next.load() < scheduler->size)
+                    (*participant)(*scheduler);
+                scheduler->active.fetch_sub(1);
+            });
+    }
+    participant(*scheduler);
+
+    while (scheduler->done.load(std::memory_order_acquire) < size ||
+           scheduler->active.load() > 0)
+        std::this_thread::yield();
+    if (scheduler->exception)
+        std::rethrow_exception(scheduler->exception);
+}
+
+} // namespace threadpool_detail
+
+// calls function(i) for every index in [first, last), or function(*it) for
+// every iterator of a random access range. The calling thread executes
+// chunks as well, a grainSize of 0 selects it automatically
+template <typename _Pool, typename _Index, typename _Function>
+void parallel_for(_Pool& pool, _Index first, _Index last, _Function&& function,
+                  size_t grainSize = 0) {
+    auto participant = [&](threadpool_detail::ParallelScheduler& scheduler) {
+        size_t begin, end, items = 0;
+        while (scheduler.claim(begin, end)) {
+            scheduler.execute([&] {
+                for (size_t i = begin; i < end; ++i)
+                    function(threadpool_detail::element(first + i));
+            });
+            items += end - begin;
+        }
+        scheduler.finish(items);
+    };
+    threadpool_detail::runParallel(pool, size_t(last - first), grainSize,
+                                   participant);
+}
+
+// output[i] = function(input[i]) for the random access range [first, last)
+template <typename _Pool, typename _InputIterator, typename _OutputIterator,
+          typename _Function>
+_OutputIterator parallel_transform(_Pool& pool, _InputIterator first,
+                                   _InputIterator last, _OutputIterator output,
+                                   _Function&& function,
+                                   size_t grainSize = 0) {
+    parallel_for(
+        pool, size_t(0), size_t(last - first),
+        [&](size_t i) { output[i] = function(first[i]); }, grainSize);
+    return output + (last - first);
+}
+
+// reduces transform(element) of [first, last) with the associative and
+// commutative operation, starting from init. Every participating thread
+// folds its chunks into one partial result, the partials are combined once
+// per thread instead of once per chunk
+template <typename _Pool, typename _Index, typename _Type,
+          typename _Operation, typename _Transform>
+_Type parallel_reduce(_Pool& pool, _Index first, _Index last, _Type init,
+                      _Operation&& operation, _Transform&& transform,
+                      size_t grainSize = 0) {
+    std::mutex mutex;
+    std::optional<_Type> total;
+    auto participant = [&](threadpool_detail::ParallelScheduler& scheduler) {
+        std::optional<_Type> partial;
+        size_t begin, end, items = 0;
+        while (scheduler.claim(begin, end)) {
+            scheduler.execute([&] {
+                size_t i = begin;
+                if (!partial)
+                    partial.emplace(
+                        transform(threadpool_detail::element(first + i++)));
+                for (; i < end; ++i)
+                    partial = operation(
+                        std::move(*partial),
+                        transform(threadpool_detail::element(first + i)));
+            });
+            items += end - begin;
+        }
+        if (partial)
+            scheduler.execute([&] {
+                std::lock_guard lock(mutex);
+                if (total)
+                    total = operation(std::move(*total), std::move(*partial));
+                else
+                    total = std::move(partial);
+            });
+        scheduler.finish(items);
+    };
+    threadpool_detail::runParallel(pool, size_t(last - first), grainSize,
+                                   participant);
+    return total ? operation(std::move(init), std::move(*total)) : init;
+}
+template <typename _Pool, typename _Index, typename _Type,
+          typename _Operation = std::plus<>>
+_Type parallel_reduce(_Pool& pool, _Index first, _Index last, _Type init,
+                      _Operation&& operation = {}) {
+    return parallel_reduce(pool, first, last, std::move(init),
+                           std::forward<_Operation>(operation),
+                           [](auto&& value) -> decltype(auto) {
+                               return std::forward<decltype(value)>(value);
+                           });
+}
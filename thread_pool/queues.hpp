@@ -0,0 +1,448 @@
+#pragma once
+#include <algorithm>
+#include <atomic>
+#include <bit>
+#include <chrono>
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <limits>
+#include <new>
+#include <ratio>
+#include <type_traits>
+#include <vector>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+
+// Scheduling queue policies for ThreadPool. A policy provides
+// Policy::Queue<_Work, _Compare>, a thread safe queue of work items (which
+// have a 'priority' member ordered by _Compare) with the interface:
+//   bool push(_Work& work)              moves the work in, false if full
+//   size_t pushBulk(_Work* first, _Work* last)
+//                                       pushes a prefix, returns its length
+//   bool pop(_Work& work)               most important work, false if empty
+//   bool peek(priority& priority)       priority of the next work to pop
+//   bool empty() const, size_t size() const (both approximate)
+
+namespace threadpool_detail {
+
+inline void cpuRelax() {
+#if defined(__x86_64__) || defined(__i386__)
+    _mm_pause();
+#elif defined(__aarch64__)
+    asm volatile("yield");
+#endif
+}
+
+// keeps the atomics written by producers and consumers on separate lines
+constexpr size_t s_CacheLineSize = 64;
+
+// bounded multi producer multi consumer ring buffer (Dmitry Vyukov's
+// design): every cell carries a sequence number telling whether it is ready
+// to be written or read in the current lap, so push and pop each need a
+// single compare exchange and never block
+template <typename _Type> class BoundedRing final {
+  public:
+    explicit BoundedRing(size_t capacity)
+        : m_Mask(capacity - 1), m_Cells(new _Cell[capacity]) {
+        for (size_t i = 0; i < capacity; ++i)
+            this->m_Cells[i].sequence.store(i, std::memory_order_relaxed);
+    }
+    ~BoundedRing() {
+        _Type value;
+        while (this->pop(value))
+            ;
+    }
+
+    bool push(_Type& value) {
+        size_t position = this->m_Enqueue.load(std::memory_order_relaxed);
+        _Cell* cell;
+        while (true) {
+            cell = &this->m_Cells[position & this->m_Mask];
+            const size_t sequence =
+                cell->sequence.load(std::memory_order_acquire);
+            const auto diff = ptrdiff_t(sequence) - ptrdiff_t(position);
+            if (diff == 0) {
+                if (this->m_Enqueue.compare_exchange_weak(
+                        position, position + 1, std::memory_order_relaxed))
+                    break;
+            } else if (diff < 0)
+                return false;
+            else
+                position = this->m_Enqueue.load(std::memory_order_relaxed);
+        }
+        ::new (static_cast<void*>(cell->storage)) _Type(std::move(value));
+        cell->sequence.store(position + 1, std::memory_order_release);
+        return true;
+    }
+    bool pop(_Type& value) {
+        size_t position = this->m_Dequeue.load(std::memory_order_relaxed);
+        _Cell* cell;
+        while (true) {
+            cell = &this->m_Cells[position & this->m_Mask];
+            const size_t sequence =
+                cell->sequence.load(std::memory_order_acquire);
+            const auto diff = ptrdiff_t(sequence) - ptrdiff_t(position + 1);
+            if (diff == 0) {
+                if (this->m_Dequeue.compare_exchange_weak(
+                        position, position + 1, std::memory_order_relaxed))
+                    break;
+            } else if (diff < 0)
+                return false;
+            else
+                position = this->m_Dequeue.load(std::memory_order_relaxed);
+        }
+        auto* stored = std::launder(reinterpret_cast<_Type*>(cell->storage));
+        value = std::move(*stored);
+        stored->~_Type();
+        cell->sequence.store(position + this->m_Mask + 1,
+                             std::memory_order_release);
+        return true;
+    }
+    size_t size() const {
+        const size_t dequeue = this->m_Dequeue.load(std::memory_order_relaxed);
+        const size_t enqueue = this->m_Enqueue.load(std::memory_order_relaxed);
+        return enqueue > dequeue ? enqueue - dequeue : 0;
+    }
+
+  private:
+    struct _Cell {
+        std::atomic<size_t> sequence;
+        alignas(_Type) unsigned char storage[sizeof(_Type)];
+    };
+
+    const size_t m_Mask;
+    const std::unique_ptr<_Cell[]> m_Cells;
+    alignas(s_CacheLineSize) std::atomic<size_t> m_Enqueue = 0;
+    alignas(s_CacheLineSize) std::atomic<size_t> m_Dequeue = 0;
+};
+
+// maps priorities onto _Levels integral levels, clamped to [0, _Levels).
+// Levels are addressed by rank, rank 0 being the most important level as
+// decided by _Compare
+template <size_t _Levels, typename _PriorityType, typename _Compare>
+struct PriorityLevels {
+    static size_t rank(const _PriorityType& priority) {
+        size_t level = 0;
+        if (priority > _PriorityType(0))
+            level = std::min<size_t>(size_t(priority), _Levels - 1);
+        return _highFirst() ? _Levels - 1 - level : level;
+    }
+    static _PriorityType priority(size_t rank) {
+        return _PriorityType(_highFirst() ? _Levels - 1 - rank : rank);
+    }
+
+  private:
+    static bool _highFirst() {
+        return _Compare()(_PriorityType(0), _PriorityType(1));
+    }
+};
+
+} // namespace threadpool_detail
+
+// default policy: binary heap guarded by a mutex, unbounded and ordered by
+// arbitrary priorities. The size is mirrored into an atomic so empty queues
+// can be skipped without taking the lock
+struct HeapQueue {
+    template <typename _Work, typename _Compare> class Queue final {
+      public:
+        using PriorityType = decltype(_Work::priority);
+
+        bool push(_Work& work) {
+            std::lock_guard lock(this->m_Mutex);
+            this->_push(work);
+            this->_updateSize();
+            return true;
+        }
+        size_t pushBulk(_Work* first, _Work* last) {
+            std::lock_guard lock(this->m_Mutex);
+            for (auto* e = first; e != last; ++e)
+                this->_push(*e);
+            this->_updateSize();
+            return last - first;
+        }
+        bool pop(_Work& work) {
+            if (this->empty())
+                return false;
+            std::lock_guard lock(this->m_Mutex);
+            if (this->m_Heap.empty())
+                return false;
+            std::pop_heap(this->m_Heap.begin(), this->m_Heap.end(),
+                          _lessImportant);
+            work = std::move(this->m_Heap.back());
+            this->m_Heap.pop_back();
+            this->_updateSize();
+            return true;
+        }
+        bool peek(PriorityType& priority) {
+            if (this->empty())
+                return false;
+            std::lock_guard lock(this->m_Mutex);
+            if (this->m_Heap.empty())
+                return false;
+            priority = this->m_Heap.front().priority;
+            return true;
+        }
+        bool empty() const { return this->size() == 0; }
+        size_t size() const {
+            return this->m_Size.load(std::memory_order_relaxed);
+        }
+
+      private:
+        static bool _lessImportant(const _Work& lhs, const _Work& rhs) {
+            return _Compare()(lhs.priority, rhs.priority);
+        }
+        void _push(_Work& work) {
+            this->m_Heap.push_back(std::move(work));
+            std::push_heap(this->m_Heap.begin(), this->m_Heap.end(),
+                           _lessImportant);
+        }
+        void _updateSize() {
+            this->m_Size.store(this->m_Heap.size(), std::memory_order_relaxed);
+        }
+
+        std::mutex m_Mutex;
+        std::vector<_Work> m_Heap;
+        std::atomic<size_t> m_Size = 0;
+    };
+};
+
+// lock free policy: one bounded MPMC ring per priority level. Priorities
+// are clamped to the integral levels [0, _Levels), _Compare decides which
+// end of the range is more important. Every level holds _Capacity items,
+// pushing into a full level fails and the pool falls back (see ThreadPool)
+template <size_t _Levels = 4, size_t _Capacity = 1024> struct LockFreeQueue {
+    static_assert(_Levels > 0, "LockFreeQueue: needs at least one level");
+    static_assert(_Capacity > 1 && (_Capacity & (_Capacity - 1)) == 0,
+                  "LockFreeQueue: capacity must be a power of two");
+
+    template <typename _Work, typename _Compare> class Queue final {
+      public:
+        using PriorityType = decltype(_Work::priority);
+
+        Queue() {
+            for (auto& e : this->m_Levels)
+                e = std::make_unique<threadpool_detail::BoundedRing<_Work>>(
+                    _Capacity);
+        }
+
+        bool push(_Work& work) {
+            return this->m_Levels[_Ranks::rank(work.priority)]->push(work);
+        }
+        size_t pushBulk(_Work* first, _Work* last) {
+            size_t count = 0;
+            for (auto* e = first; e != last && this->push(*e); ++e)
+                ++count;
+            return count;
+        }
+        bool pop(_Work& work) {
+            for (auto& e : this->m_Levels)
+                if (e->pop(work))
+                    return true;
+            return false;
+        }
+        bool peek(PriorityType& priority) {
+            for (size_t i = 0; i < _Levels; ++i)
+                if (this->m_Levels[i]->size()) {
+                    priority = _Ranks::priority(i);
+                    return true;
+                }
+            return false;
+        }
+        bool empty() const { return this->size() == 0; }
+        size_t size() const {
+            size_t result = 0;
+            for (auto& e : this->m_Levels)
+                result += e->size();
+            return result;
+        }
+
+      private:
+        using _Ranks =
+            threadpool_detail::PriorityLevels<_Levels, PriorityType, _Compare>;
+
+        // indexed by rank
+        std::unique_ptr<threadpool_detail::BoundedRing<_Work>>
+            m_Levels[_Levels];
+    };
+};
+
+// bucket policy: one FIFO per priority level plus a bitmap of the non empty
+// levels, guarded by a mutex. Push and pop are O(1) (a bit scan finds the
+// most important level) and work of equal priority runs in FIFO order.
+// Priorities are clamped to the integral levels [0, _Levels) like in
+// LockFreeQueue, the queue itself is unbounded
+template <size_t _Levels = 8> struct BucketQueue {
+    static_assert(_Levels > 0 && _Levels <= 64,
+                  "BucketQueue: supports 1 to 64 levels");
+
+    template <typename _Work, typename _Compare> class Queue final {
+      public:
+        using PriorityType = decltype(_Work::priority);
+
+        bool push(_Work& work) {
+            std::lock_guard lock(this->m_Mutex);
+            this->_push(work);
+            return true;
+        }
+        size_t pushBulk(_Work* first, _Work* last) {
+            std::lock_guard lock(this->m_Mutex);
+            for (auto* e = first; e != last; ++e)
+                this->_push(*e);
+            return last - first;
+        }
+        bool pop(_Work& work) {
+            if (this->empty())
+                return false;
+            std::lock_guard lock(this->m_Mutex);
+            if (!this->m_NonEmpty)
+                return false;
+            const size_t rank = std::countr_zero(this->m_NonEmpty);
+            auto& bucket = this->m_Buckets[rank];
+            work = std::move(bucket.front());
+            bucket.pop_front();
+            if (bucket.empty())
+                this->m_NonEmpty &= ~(uint64_t(1) << rank);
+            this->m_Size.fetch_sub(1, std::memory_order_relaxed);
+            return true;
+        }
+        bool peek(PriorityType& priority) {
+            if (this->empty())
+                return false;
+            std::lock_guard lock(this->m_Mutex);
+            if (!this->m_NonEmpty)
+                return false;
+            priority = _Ranks::priority(std::countr_zero(this->m_NonEmpty));
+            return true;
+        }
+        bool empty() const { return this->size() == 0; }
+        size_t size() const {
+            return this->m_Size.load(std::memory_order_relaxed);
+        }
+
+      private:
+        using _Ranks =
+            threadpool_detail::PriorityLevels<_Levels, PriorityType, _Compare>;
+
+        void _push(_Work& work) {
+            const size_t rank = _Ranks::rank(work.priority);
+            this->m_Buckets[rank].push_back(std::move(work));
+            this->m_NonEmpty |= uint64_t(1) << rank;
+            this->m_Size.fetch_add(1, std::memory_order_relaxed);
+        }
+
+        std::mutex m_Mutex;
+        // bit n set: bucket of rank n holds work
+        uint64_t m_NonEmpty = 0;
+        std::deque<_Work> m_Buckets[_Levels];
+        std::atomic<size_t> m_Size = 0;
+    };
+};
+
+// aging policy: a binary heap like HeapQueue, but the effective priority of
+// queued work rises by _Rate priority levels per second of waiting, so a
+// steady stream of important work can't starve the rest. Comparing
+// p1 + r * (now - t1) with p2 + r * (now - t2) doesn't depend on now, which
+// keys the heap by p - r * t once at push and keeps push and pop O(log n).
+// Priorities must be arithmetic, _Compare decides which direction is more
+// important like in LockFreeQueue. peek reports the aged priority
+template <typename _Rate = std::ratio<1>> struct AgingQueue {
+    static_assert(_Rate::num > 0, "AgingQueue: the rate must be positive");
+
+    template <typename _Work, typename _Compare> class Queue final {
+      public:
+        using PriorityType = decltype(_Work::priority);
+        static_assert(std::is_arithmetic_v<PriorityType>,
+                      "AgingQueue: needs arithmetic priorities");
+
+        bool push(_Work& work) {
+            const double now = this->_now();
+            std::lock_guard lock(this->m_Mutex);
+            this->_push(work, now);
+            this->_updateSize();
+            return true;
+        }
+        size_t pushBulk(_Work* first, _Work* last) {
+            const double now = this->_now();
+            std::lock_guard lock(this->m_Mutex);
+            for (auto* e = first; e != last; ++e)
+                this->_push(*e, now);
+            this->_updateSize();
+            return last - first;
+        }
+        bool pop(_Work& work) {
+            if (this->empty())
+                return false;
+            std::lock_guard lock(this->m_Mutex);
+            if (this->m_Heap.empty())
+                return false;
+            std::pop_heap(this->m_Heap.begin(), this->m_Heap.end(),
+                          _lessImportant);
+            work = std::move(this->m_Heap.back().work);
+            this->m_Heap.pop_back();
+            this->_updateSize();
+            return true;
+        }
+        bool peek(PriorityType& priority) {
+            if (this->empty())
+                return false;
+            const double now = this->_now();
+            std::lock_guard lock(this->m_Mutex);
+            if (this->m_Heap.empty())
+                return false;
+            double aged = this->m_Heap.front().key + s_Rate * now;
+            if (!_highFirst())
+                aged = -aged;
+            using _Limits = std::numeric_limits<PriorityType>;
+            priority = PriorityType(std::clamp<double>(
+                aged, double(_Limits::lowest()), double(_Limits::max())));
+            return true;
+        }
+        bool empty() const { return this->size() == 0; }
+        size_t size() const {
+            return this->m_Size.load(std::memory_order_relaxed);
+        }
+
+      private:
+        struct _Entry {
+            // larger is more important
+            double key;
+            _Work work;
+        };
+
+        static constexpr double s_Rate = double(_Rate::num) / _Rate::den;
+
+        static bool _highFirst() {
+            return _Compare()(PriorityType(0), PriorityType(1));
+        }
+        static bool _lessImportant(const _Entry& lhs, const _Entry& rhs) {
+            return lhs.key < rhs.key;
+        }
+        // seconds since the queue was created
+        double _now() const {
+            const std::chrono::duration<double> elapsed =
+                std::chrono::steady_clock::now() - this->m_Epoch;
+            return elapsed.count();
+        }
+        void _push(_Work& work, double now) {
+            const double priority = double(work.priority);
+            const double key =
+                (_highFirst() ? priority : -priority) - s_Rate * now;
+            this->m_Heap.push_back({key, std::move(work)});
+            std::push_heap(this->m_Heap.begin(), this->m_Heap.end(),
+                           _lessImportant);
+        }
+        void _updateSize() {
+            this->m_Size.store(this->m_Heap.size(), std::memory_order_relaxed);
+        }
+
+        const std::chrono::steady_clock::time_point m_Epoch =
+            std::chrono::steady_clock::now();
+        std::mutex m_Mutex;
+        std::vector<_Entry> m_Heap;
+        std::atomic<size_t> m_Size = 0;
+    };
+};
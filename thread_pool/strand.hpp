@@ -0,0 +1,172 @@
+#pragma once
+#include "future.hpp"
+#include "uniquefunction.hpp"
+#include <coroutine>
+#include <memory>
+#include <mutex>
+#include <tuple>
+#include <type_traits>
+#include <utility>
+
+// serial executor on top of a pool (or any Executor): tasks posted to a
+// strand run one at a time in FIFO order, possibly on different workers.
+// Nothing blocks while a task waits for its turn, the strand's queue is
+// drained by a single pool task which is only dispatched while the strand
+// has work. The queue is an intrusive list, an idle strand is just its
+// state (one allocation of about a hundred bytes), so thousands of strands
+// can share a pool. Queued tasks keep the strand's state alive, the strand
+// object itself can go away before they ran. The pool has to outlive them,
+// if it drops the drain task (shutting down) the queued tasks are destroyed,
+// breaking their promises
+class Strand final {
+  public:
+    explicit Strand(Executor executor)
+        : m_State(std::make_shared<_State>(executor)) {}
+
+    // makes the strand usable as an Executor for continuations
+    void post(UniqueFunction<void()> task) {
+        auto* node = new _Node{std::move(task)};
+        bool schedule;
+        {
+            std::lock_guard lock(this->m_State->mutex);
+            auto& state = *this->m_State;
+            (state.tail ? state.tail->next : state.head) = node;
+            state.tail = node;
+            schedule = !std::exchange(state.scheduled, true);
+        }
+        if (schedule)
+            _schedule(this->m_State);
+    }
+
+    // like ThreadPool::dispatchWork, without priorities. Continuations of
+    // the future run on the pool
+    template <typename _Function, typename... _Args>
+    auto dispatchWork(_Function&& function, _Args&&... args) {
+        using _Result = decltype(function(args...));
+        auto bound = [function = std::forward<_Function>(function),
+                      args = std::make_tuple(std::forward<_Args>(
+                          args)...)]() mutable -> decltype(auto) {
+            return std::apply(function, args);
+        };
+        if constexpr (std::is_void_v<_Result>)
+            this->post(std::move(bound));
+        else {
+            Promise<_Result> promise;
+            promise.setExecutor(this->m_State->executor);
+            auto future = promise.getFuture();
+            this->post([promise = std::move(promise),
+                        bound = std::move(bound)]() mutable {
+                promise.setValueFrom(bound);
+            });
+            return future;
+        }
+    }
+
+    // co_await strand.schedule() resumes the coroutine as a task of the
+    // strand
+    auto schedule() { return _ScheduleAwaitable{this}; }
+
+    // true inside a task of this strand
+    bool runningInThisThread() const {
+        return s_Current == this->m_State.get();
+    }
+
+  private:
+    struct _Node {
+        UniqueFunction<void()> task;
+        _Node* next = nullptr;
+    };
+    struct _State {
+        explicit _State(Executor exec) : executor(exec) {}
+        ~_State() { _deleteNodes(this->head); }
+
+        const Executor executor;
+        std::mutex mutex;
+        // queued tasks, oldest first
+        _Node* head = nullptr;
+        _Node* tail = nullptr;
+        // a drain task is queued or running
+        bool scheduled = false;
+    };
+
+    struct _ScheduleAwaitable {
+        bool await_ready() const noexcept { return false; }
+        void await_suspend(std::coroutine_handle<> handle) {
+            this->strand->post(threadpool_detail::Resumer(handle));
+        }
+        void await_resume() const noexcept {}
+
+        Strand* strand;
+    };
+
+    // held by the drain task: dropped without running (the pool shut down)
+    // it gives the queued tasks up, destroying them breaks their promises,
+    // and the next post schedules a drain again
+    class _DrainTicket {
+      public:
+        explicit _DrainTicket(std::shared_ptr<_State> state)
+            : m_State(std::move(state)) {}
+        _DrainTicket(_DrainTicket&&) noexcept = default;
+        _DrainTicket& operator=(_DrainTicket&&) = delete;
+        ~_DrainTicket() {
+            if (this->m_State)
+                _abandon(*this->m_State);
+        }
+
+        std::shared_ptr<_State> take() { return std::move(this->m_State); }
+
+      private:
+        std::shared_ptr<_State> m_State;
+    };
+
+    static void _schedule(std::shared_ptr<_State> state) {
+        const Executor executor = state->executor;
+        executor.post([ticket = _DrainTicket(std::move(state))]() mutable {
+            auto state = ticket.take();
+            if (_drain(*state))
+                _schedule(std::move(state));
+        });
+    }
+    static void _abandon(_State& state) {
+        _Node* head;
+        {
+            std::lock_guard lock(state.mutex);
+            head = std::exchange(state.head, nullptr);
+            state.tail = nullptr;
+            state.scheduled = false;
+        }
+        _deleteNodes(head);
+    }
+    static void _deleteNodes(_Node* head) {
+        while (head)
+            delete std::exchange(head, head->next);
+    }
+    // runs a batch of tasks, returns true if the strand has more. Giving
+    // the worker back in between keeps a busy strand from starving the
+    // pool's other work
+    static bool _drain(_State& state) {
+        const _State* previous = std::exchange(s_Current, &state);
+        for (size_t i = 0; i < s_MaxBatch; ++i) {
+            std::unique_ptr<_Node> node;
+            {
+                std::lock_guard lock(state.mutex);
+                if (!state.head) {
+                    state.scheduled = false;
+                    s_Current = previous;
+                    return false;
+                }
+                node.reset(std::exchange(state.head, state.head->next));
+                if (!state.head)
+                    state.tail = nullptr;
+            }
+            node->task();
+        }
+        s_Current = previous;
+        return true;
+    }
+
+    static constexpr size_t s_MaxBatch = 64;
+    static inline thread_local const _State* s_Current = nullptr;
+
+    const std::shared_ptr<_State> m_State;
+};
@@ -0,0 +1,247 @@
+#pragma once
+#include "future.hpp"
+#include "uniquefunction.hpp"
+#include <atomic>
+#include <deque>
+#include <exception>
+#include <future>
+#include <stdexcept>
+#include <utility>
+#include <vector>
+
+// graph of tasks with dependencies, nodes are dispatched as soon as all of
+// their predecessors finished. The graph is built once and can be run any
+// number of times (one run at a time), runs don't allocate nodes again.
+// The graph has to outlive its runs
+class TaskGraph final {
+  public:
+    using NodeId = size_t;
+
+    template <typename _Function> NodeId addNode(_Function&& function) {
+        this->_checkIdle();
+        this->m_Nodes.emplace_back(std::forward<_Function>(function));
+        this->m_Validated = false;
+        return this->m_Nodes.size() - 1;
+    }
+    // node 'to' runs after node 'from' finished
+    void addEdge(NodeId from, NodeId to) {
+        this->_checkIdle();
+        if (from >= this->m_Nodes.size() || to >= this->m_Nodes.size())
+            throw std::out_of_range("TaskGraph: invalid node id");
+        this->m_Nodes[from].successors.push_back(to);
+        ++this->m_Nodes[to].numPredecessors;
+        this->m_Validated = false;
+    }
+
+    size_t size() const { return this->m_Nodes.size(); }
+
+    // executes the graph on the pool, the future holds the first exception
+    // thrown by a node, after a failure the remaining nodes are skipped.
+    // Nodes the pool refuses or drops (shutting down) fail the run as well
+    template <typename _Pool> Future<void> run(_Pool& pool) {
+        return this->run(pool, typename _Pool::PriorityType());
+    }
+    template <typename _Pool, typename _PType>
+    Future<void> run(_Pool& pool, const _PType& priority) {
+        if (this->m_Running.exchange(true))
+            throw std::logic_error("TaskGraph: graph is already running");
+        try {
+            this->_validate();
+        } catch (...) {
+            this->m_Running = false;
+            throw;
+        }
+
+        this->m_Promise = Promise<void>();
+        auto future = this->m_Promise.getFuture();
+        if (this->m_Nodes.empty()) {
+            this->_finish();
+            return future;
+        }
+        this->m_Schedule = [this, &pool, priority](NodeId id) {
+            pool.dispatchWork(priority,
+                              [ticket = _Ticket(this, id)]() mutable {
+                                  ticket.run();
+                              });
+        };
+        this->m_Failed = false;
+        this->m_Exception = nullptr;
+        this->m_Remaining = this->m_Nodes.size();
+        for (auto& e : this->m_Nodes)
+            e.pending.store(e.numPredecessors, std::memory_order_relaxed);
+        // the run may finish (and the graph go away) as soon as the last
+        // root is dispatched
+        const NodeId lastRoot = this->m_Roots.back();
+        for (size_t i = 0; i + 1 < this->m_Roots.size(); ++i)
+            this->_dispatch(this->m_Roots[i]);
+        this->_dispatch(lastRoot);
+        return future;
+    }
+
+  private:
+    // held by every node task: a task the pool drops without running it
+    // (shutdownNow, the pool's destructor) fails the run with a
+    // broken_promise and is walked like a refused one
+    class _Ticket {
+      public:
+        _Ticket(TaskGraph* graph, NodeId id) : m_Graph(graph), m_Id(id) {}
+        _Ticket(_Ticket&& rhs) noexcept
+            : m_Graph(std::exchange(rhs.m_Graph, nullptr)), m_Id(rhs.m_Id) {}
+        _Ticket& operator=(_Ticket&&) = delete;
+        ~_Ticket() {
+            if (this->m_Graph)
+                this->m_Graph->_dropped(this->m_Id);
+        }
+
+        void run() {
+            std::exchange(this->m_Graph, nullptr)->_execute(this->m_Id);
+        }
+
+      private:
+        TaskGraph* m_Graph;
+        NodeId m_Id;
+    };
+
+    struct _Node {
+        template <typename _Function>
+        _Node(_Function&& foo) : function(std::forward<_Function>(foo)) {}
+
+        UniqueFunction<void()> function;
+        std::vector<NodeId> successors;
+        size_t numPredecessors = 0;
+        std::atomic<size_t> pending = 0;
+    };
+
+    void _checkIdle() const {
+        if (this->m_Running)
+            throw std::logic_error("TaskGraph: graph is running");
+    }
+    // Kahn's algorithm, a cycle would never finish
+    void _validate() {
+        if (this->m_Validated)
+            return;
+        std::vector<size_t> inDegree, ready;
+        inDegree.reserve(this->m_Nodes.size());
+        for (NodeId id = 0; id < this->m_Nodes.size(); ++id) {
+            inDegree.push_back(this->m_Nodes[id].numPredecessors);
+            if (inDegree.back() == 0)
+                ready.push_back(id);
+        }
+        this->m_Roots = ready;
+        size_t visited = 0;
+        while (!ready.empty()) {
+            const NodeId id = ready.back();
+            ready.pop_back();
+            ++visited;
+            for (const NodeId e : this->m_Nodes[id].successors)
+                if (--inDegree[e] == 0)
+                    ready.push_back(e);
+        }
+        if (visited != this->m_Nodes.size())
+            throw std::invalid_argument("TaskGraph: graph contains a cycle");
+        this->m_Validated = true;
+    }
+
+    // one ready successor continues on this thread, the others are
+    // dispatched to the pool
+    void _execute(NodeId id) {
+        while (true) {
+            auto& node = this->m_Nodes[id];
+            if (!this->m_Failed.load(std::memory_order_relaxed)) {
+                try {
+                    node.function();
+                } catch (...) {
+                    this->_fail(std::current_exception());
+                }
+            }
+
+            NodeId next = s_NoNode;
+            for (const NodeId e : node.successors) {
+                if (this->m_Nodes[e].pending.fetch_sub(
+                        1, std::memory_order_acq_rel) != 1)
+                    continue;
+                if (next != s_NoNode)
+                    this->_dispatch(next);
+                next = e;
+            }
+            // without a pending successor another thread may finish the
+            // run right after the decrement, the graph mustn't be touched
+            if (this->m_Remaining.fetch_sub(1, std::memory_order_acq_rel) ==
+                1) {
+                this->_finish();
+                return;
+            }
+            if (next == s_NoNode)
+                return;
+            id = next;
+        }
+    }
+    // a node the pool refused (a bounded pool rejecting, say) or dropped
+    // right away fails the run, it is walked on this thread, skipping the
+    // functions, so the run still finishes
+    void _dispatch(NodeId id) {
+        const auto previous =
+            std::exchange(s_Dispatching, _Dispatching{this, id, false});
+        std::exception_ptr refused;
+        try {
+            this->m_Schedule(id);
+        } catch (...) {
+            refused = std::current_exception();
+        }
+        const bool dropped = std::exchange(s_Dispatching, previous).dropped;
+        if (!refused && !dropped)
+            return;
+        this->_fail(refused ? refused
+                            : std::make_exception_ptr(std::future_error(
+                                  std::future_errc::broken_promise)));
+        this->_execute(id);
+    }
+    void _dropped(NodeId id) {
+        // dropped by the dispatch itself, _dispatch walks it
+        if (s_Dispatching.graph == this && s_Dispatching.id == id) {
+            s_Dispatching.dropped = true;
+            return;
+        }
+        this->_fail(std::make_exception_ptr(
+            std::future_error(std::future_errc::broken_promise)));
+        this->_execute(id);
+    }
+    void _fail(std::exception_ptr exception) {
+        if (!this->m_Failed.exchange(true))
+            this->m_Exception = std::move(exception);
+    }
+    // the graph may be destroyed or run again as soon as the promise is set
+    void _finish() {
+        auto promise = std::move(this->m_Promise);
+        auto exception = std::move(this->m_Exception);
+        this->m_Running = false;
+        if (exception)
+            promise.setException(std::move(exception));
+        else
+            promise.setValue();
+    }
+
+    static constexpr NodeId s_NoNode = NodeId(-1);
+    // the node _dispatch is handing to a pool on this thread
+    struct _Dispatching {
+        const TaskGraph* graph;
+        NodeId id;
+        // its task was dropped before the pool returned
+        bool dropped;
+    };
+    static inline thread_local _Dispatching s_Dispatching{nullptr, s_NoNode,
+                                                          false};
+
+    // deque: growing never moves the nodes and their atomics
+    std::deque<_Node> m_Nodes;
+    // nodes without predecessors, set by _validate
+    std::vector<NodeId> m_Roots;
+    bool m_Validated = false;
+
+    std::atomic<bool> m_Running = false;
+    std::atomic<size_t> m_Remaining = 0;
+    std::atomic<bool> m_Failed = false;
+    std::exception_ptr m_Exception;
+    Promise<void> m_Promise;
+    UniqueFunction<void(NodeId)> m_Schedule;
+};
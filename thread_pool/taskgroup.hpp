@@ -0,0 +1,144 @@
+#pragma once
+#include "threadpool.hpp"
+#include <atomic>
+#include <concepts>
+#include <cstdint>
+#include <exception>
+#include <stop_token>
+#include <thread>
+#include <tuple>
+#include <utility>
+
+namespace threadpool_detail {
+// bumped whenever a task group runs empty, waiters block on it instead of
+// on the group's counter: the last task must not touch the group after
+// its decrement, the waiter may destroy it right away
+inline std::atomic<uint32_t> s_TaskGroupEpoch = 0;
+} // namespace threadpool_detail
+
+// dynamic set of tasks on a pool which is waited for as a whole, without a
+// future per task: the group is one atomic counter of unfinished tasks, a
+// slot for the first exception and a stop source. The first exception
+// cancels the group, tasks which didn't start yet are skipped. Tasks can
+// run more tasks in their group, tasks dropped by a pool shutting down count
+// as skipped. The destructor waits (but doesn't throw), so the group and
+// everything its tasks reference can live on the stack
+template <typename _Pool> class TaskGroup final {
+  public:
+    using PriorityType = typename _Pool::PriorityType;
+
+    explicit TaskGroup(_Pool& pool) : m_Pool(pool) {}
+    ~TaskGroup() { this->_wait(); }
+    TaskGroup(const TaskGroup&) = delete;
+    TaskGroup& operator=(const TaskGroup&) = delete;
+
+    // function(args...), or function(token, args...) if it takes the
+    // group's std::stop_token to notice a cancellation while running
+    template <typename _Function, typename... _Args>
+        requires std::invocable<std::decay_t<_Function>&,
+                                std::decay_t<_Args>&...> ||
+                 std::invocable<std::decay_t<_Function>&, std::stop_token&,
+                                std::decay_t<_Args>&...>
+    void run(_Function&& function, _Args&&... args) {
+        this->run(PriorityType(), std::forward<_Function>(function),
+                  std::forward<_Args>(args)...);
+    }
+    template <typename _PType, typename _Function, typename... _Args>
+        requires std::convertible_to<_PType, PriorityType>
+    void run(_PType&& priority, _Function&& function, _Args&&... args) {
+        this->m_Unfinished.fetch_add(1);
+        // a rejected task (bounded pool) is finished by its ticket as well
+        this->m_Pool.dispatchWork(
+            std::forward<_PType>(priority),
+            [ticket = _Ticket(this),
+             function = std::forward<_Function>(function),
+             args = std::make_tuple(std::forward<_Args>(args)...)]() mutable {
+                ticket.take()->_run(function, args);
+            });
+    }
+
+    // blocks until every task of the group finished, running queued work of
+    // the pool meanwhile. Rethrows the first exception a task threw (once)
+    void wait() {
+        this->_wait();
+        if (this->m_Failed.load() && this->m_Exception)
+            std::rethrow_exception(std::exchange(this->m_Exception, nullptr));
+    }
+
+    // tasks which didn't start yet are skipped, running ones see the stop
+    // token. Irreversible, later runs are skipped as well
+    void cancel() { this->m_StopSource.request_stop(); }
+    bool isCancelled() const { return this->m_StopSource.stop_requested(); }
+
+  private:
+    // held by every task: a task destroyed without running (rejected, or
+    // dropped by shutdownNow or the pool's destructor) still finishes, so
+    // waiting for the group doesn't hang
+    class _Ticket {
+      public:
+        explicit _Ticket(TaskGroup* group) : m_Group(group) {}
+        _Ticket(_Ticket&& rhs) noexcept
+            : m_Group(std::exchange(rhs.m_Group, nullptr)) {}
+        _Ticket& operator=(_Ticket&&) = delete;
+        ~_Ticket() {
+            if (this->m_Group)
+                this->m_Group->_finishOne();
+        }
+
+        TaskGroup* take() { return std::exchange(this->m_Group, nullptr); }
+
+      private:
+        TaskGroup* m_Group;
+    };
+
+    template <typename _Function, typename _Tuple>
+    void _run(_Function& function, _Tuple& args) {
+        auto token = this->m_StopSource.get_token();
+        if (!token.stop_requested()) {
+            try {
+                std::apply(
+                    [&](auto&... unpacked) {
+                        threadpool_detail::invokeWithToken(function, token,
+                                                           unpacked...);
+                    },
+                    args);
+            } catch (...) {
+                if (!this->m_Failed.exchange(true))
+                    this->m_Exception = std::current_exception();
+                this->cancel();
+            }
+        }
+        this->_finishOne();
+    }
+    void _finishOne() {
+        if (this->m_Unfinished.fetch_sub(1) != 1)
+            return;
+        // the group may be gone from here on
+        threadpool_detail::s_TaskGroupEpoch.fetch_add(1);
+        threadpool_detail::s_TaskGroupEpoch.notify_all();
+    }
+
+    // workers keep polling: blocking one could leave the task it waits for
+    // without a worker
+    void _wait() {
+        auto& epoch = threadpool_detail::s_TaskGroupEpoch;
+        while (true) {
+            const uint32_t seen = epoch.load();
+            if (this->m_Unfinished.load() == 0)
+                return;
+            if (this->m_Pool.tryRunPendingTask())
+                continue;
+            if (this->m_Pool.isWorkerThread())
+                std::this_thread::yield();
+            else
+                epoch.wait(seen);
+        }
+    }
+
+    _Pool& m_Pool;
+    std::atomic<size_t> m_Unfinished = 0;
+    std::atomic<bool> m_Failed = false;
+    // written by the first failing task, read after waiting
+    std::exception_ptr m_Exception;
+    std::stop_source m_StopSource;
+};
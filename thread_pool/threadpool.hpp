@@ -1,72 +1,287 @@
 #pragma once
+#include "future.hpp"
+#include "metrics.hpp"
+#include "queues.hpp"
+#include "timer.hpp"
+#include "topology.hpp"
+#include "trace.hpp"
+#include "uniquefunction.hpp"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
 #include <functional>
-#include <future>
+#include <iterator>
+#include <memory>
 #include <mutex>
-#include <queue>
+#include <optional>
+#include <stdexcept>
+#include <stop_token>
 #include <thread>
+#include <tuple>
 #include <vector>
 
+// stored in the future of a cancellable task which was cancelled before it
+// started
+class TaskCancelled : public std::runtime_error {
+  public:
+    TaskCancelled() : std::runtime_error("ThreadPool: task was cancelled") {}
+};
+
+namespace threadpool_detail {
+
+// passes the token to functions which take it as their first argument
+template <typename _Function, typename... _Args>
+    requires std::invocable<_Function&, std::stop_token&, _Args&...>
+decltype(auto) invokeWithToken(_Function& function, std::stop_token& token,
+                               _Args&... args) {
+    return function(token, args...);
+}
+template <typename _Function, typename... _Args>
+    requires(!std::invocable<_Function&, std::stop_token&, _Args&...> &&
+             std::invocable<_Function&, _Args&...>)
+decltype(auto) invokeWithToken(_Function& function, std::stop_token&,
+                               _Args&... args) {
+    return function(args...);
+}
+
+template <typename _Function, typename... _Args>
+using CancellableResult = decltype(invokeWithToken(
+    std::declval<std::decay_t<_Function>&>(),
+    std::declval<std::stop_token&>(), std::declval<std::decay_t<_Args>&>()...));
+// what dispatchCancellable returns, like dispatchWork
+template <typename _Function, typename... _Args>
+using CancellableDispatch =
+    std::conditional_t<std::is_void_v<CancellableResult<_Function, _Args...>>,
+                       void, Future<CancellableResult<_Function, _Args...>>>;
+
+} // namespace threadpool_detail
+
+// what dispatchWork does once the pool holds 'capacity' queued tasks
+enum class OverflowPolicy {
+    // the producer waits until a worker made room
+    Block,
+    // dispatchWork throws std::runtime_error
+    Reject,
+    // the producer runs the task itself
+    CallerRuns,
+};
+
+struct ThreadPoolOptions {
+    size_t numThreads = std::thread::hardware_concurrency();
+
+    // every worker owns a local queue, work dispatched from inside a worker
+    // is pushed to that workers queue and idle workers steal from the others
+    bool workStealing = false;
+
+    // idle workers spin up to spinIterations pause instructions, then yield
+    // yieldIterations times before they park. Each worker adapts its spin
+    // period: it grows while spinning finds work and shrinks while it
+    // doesn't. Zero for both parks right away. Spinning takes a core away
+    // from the workers which have work, at most cores - 1 workers spin at a
+    // time (none on a single core), the others go on yielding
+    size_t spinIterations = 2048;
+    size_t yieldIterations = 16;
+
+    // number of submission queues, zero disables sharding. Every producer
+    // thread pushes into its own shard instead of the one shared queue, so
+    // concurrent producers don't contend. Workers drain the shards round
+    // robin, priorities are then only ordered within a shard
+    size_t submissionShards = 0;
+
+    // cpus the workers may run on, empty for no restriction. With pinWorkers
+    // every worker is bound to a single cpu of the set (or of all cpus if
+    // the set is empty), assigned round robin
+    std::vector<size_t> cpuSet;
+    bool pinWorkers = false;
+
+    // NUMA partitioned mode: the nodes are read from /sys, every node gets
+    // its own shared queue and workers are spread over the nodes, keep to
+    // their node's cpus and steal from workers of their node first
+    bool numaAware = false;
+
+    // upper bound for resize and elastic growth, zero selects the larger of
+    // numThreads and the number of cores. Slots for all of them are
+    // allocated up front
+    size_t maxThreads = 0;
+
+    // elastic mode: workers are spawned while work queues up and no worker
+    // is idle, workers idle for idleTimeout retire down to minThreads
+    bool elastic = false;
+    size_t minThreads = 1;
+    std::chrono::milliseconds idleTimeout = std::chrono::seconds(10);
+
+    // maximum number of queued (not yet running) tasks, zero for unbounded.
+    // Workers never block or reject, they run overflowing work themselves,
+    // as do continuations and coroutines (instead of being rejected)
+    size_t capacity = 0;
+    OverflowPolicy overflow = OverflowPolicy::Block;
+
+    // onHighWatermark is called once the queued tasks reach highWatermark
+    // (zero disables both callbacks), onLowWatermark once they dropped to
+    // lowWatermark again. They alternate and run on the dispatching or the
+    // worker thread which crossed the mark, so they should be short
+    size_t highWatermark = 0, lowWatermark = 0;
+    std::function<void()> onHighWatermark, onLowWatermark;
+
+    // upper bound of the elastic blocking lane, see dispatchBlocking
+    size_t maxBlockingThreads = 64;
+
+    // task events kept per worker when compiled with THREADPOOL_TRACING,
+    // see trace.hpp. A worker slot allocates its ring when its first thread
+    // starts
+    size_t traceBufferSize = size_t(1) << 15;
+};
+
+// _QueuePolicy selects the scheduling queue implementation, see queues.hpp
 template <typename _PriorityType = int,
-          typename _Compare = std::less<_PriorityType>>
+          typename _Compare = std::less<_PriorityType>,
+          typename _QueuePolicy = HeapQueue>
 struct ThreadPool final {
-    ThreadPool(const size_t numThreads = std::thread::hardware_concurrency())
-        : m_Threads(numThreads) {
-        auto workerFunction = [this] {
-            while (!this->m_Stop) {
-                std::unique_lock lock(this->m_Mutex);
-                this->m_ConditionVariable.wait(lock, [this] {
-                    return this->m_Stop || !this->m_Queue.empty();
-                });
-                if (this->m_Stop)
-                    break;
+    using PriorityType = _PriorityType;
 
-                auto task = std::move(this->m_Queue.top().function);
-                this->m_Queue.pop();
-                lock.unlock();
-                task();
-            }
-        };
-        for (auto& e : this->m_Threads)
-            e = std::thread(workerFunction);
+    ThreadPool(const size_t numThreads = std::thread::hardware_concurrency())
+        : ThreadPool([numThreads] {
+              ThreadPoolOptions options;
+              options.numThreads = numThreads;
+              return options;
+          }()) {}
+    ThreadPool(const ThreadPoolOptions& options)
+        : m_WorkStealing(options.workStealing),
+          m_SpinIterations(options.spinIterations),
+          m_YieldIterations(options.yieldIterations),
+          m_MaxSpinners(
+              std::max(std::thread::hardware_concurrency(), 1u) - 1),
+          m_Elastic(options.elastic), m_MinThreads(options.minThreads),
+          m_IdleTimeout(options.idleTimeout), m_Capacity(options.capacity),
+          m_Overflow(options.overflow),
+          m_HighWatermark(options.highWatermark),
+          m_LowWatermark(options.lowWatermark),
+          m_OnHighWatermark(options.onHighWatermark),
+          m_OnLowWatermark(options.onLowWatermark),
+          m_MaxBlockingThreads(options.maxBlockingThreads),
+          m_CpuSet(options.cpuSet) {
+        if (options.highWatermark &&
+            options.lowWatermark >= options.highWatermark)
+            throw std::invalid_argument(
+                "ThreadPool: lowWatermark must be below highWatermark");
+        const size_t capacity =
+            options.maxThreads
+                ? options.maxThreads
+                : std::max<size_t>(options.numThreads,
+                                   std::thread::hardware_concurrency());
+        if (options.numThreads > capacity)
+            throw std::invalid_argument(
+                "ThreadPool: numThreads exceeds maxThreads");
+        this->m_Workers.reserve(capacity);
+        for (size_t i = 0; i < capacity; ++i)
+            this->m_Workers.push_back(
+                std::make_unique<_Worker>(i, options.spinIterations));
+        if (options.workStealing)
+            for (auto& e : this->m_Workers)
+                e->queue = std::make_unique<_Queue>();
+#if THREADPOOL_TRACING
+        this->m_TraceBufferSize = options.traceBufferSize;
+#endif
+        this->m_Shards.reserve(options.submissionShards);
+        for (size_t i = 0; i < options.submissionShards; ++i)
+            this->m_Shards.push_back(std::make_unique<_Queue>());
+        this->_placeWorkers(options);
+        this->resize(options.numThreads);
     }
+    // running tasks are finished, queued ones are dropped (breaking their
+    // promises), call drain() first to run them
     ~ThreadPool() {
-        {
-            std::lock_guard lock(this->m_Mutex);
-            this->m_Stop = true;
+        this->_stop();
+        this->_takeQueued();
+        // after the workers, which may still wait in blockInPlace
+        if (auto* lane = this->m_BlockingLane.load()) {
+            lane->_stop();
+            lane->_takeQueued();
         }
-        this->m_ConditionVariable.notify_all();
-        for (auto& e : this->m_Threads)
-            e.join();
+    }
+
+    // blocks until every queued task finished, including the tasks they
+    // dispatch meanwhile. The workers keep running at full speed and the
+    // pool stays usable afterwards. Returns early if the pool is shut down
+    void drain() {
+        this->_checkExternal();
+        do {
+            this->m_Draining.fetch_add(1);
+            std::unique_lock lock(this->m_Mutex);
+            this->m_DrainedCondition.wait(lock,
+                                          [this] { return this->_drained(); });
+            this->m_Draining.fetch_sub(1);
+            lock.unlock();
+            // blocking tasks may dispatch cpu tasks and the other way round
+            if (auto* lane = this->m_BlockingLane.load())
+                lane->drain();
+        } while (!this->_laneDrained());
+    }
+    // drain bounded by a deadline, returns false if work is left. A rolling
+    // restart can follow up with shutdownNow to take the rest
+    template <typename _Clock, typename _Duration>
+    bool drainUntil(const std::chrono::time_point<_Clock, _Duration>& deadline) {
+        this->_checkExternal();
+        do {
+            this->m_Draining.fetch_add(1);
+            std::unique_lock lock(this->m_Mutex);
+            const bool drained = this->m_DrainedCondition.wait_until(
+                lock, deadline, [this] { return this->_drained(); });
+            this->m_Draining.fetch_sub(1);
+            lock.unlock();
+            auto* lane = this->m_BlockingLane.load();
+            if (!drained || (lane && !lane->drainUntil(deadline)))
+                return false;
+        } while (!this->_laneDrained());
+        return true;
+    }
+    template <typename _Rep, typename _Period>
+    bool drainFor(const std::chrono::duration<_Rep, _Period>& timeout) {
+        return this->drainUntil(std::chrono::steady_clock::now() + timeout);
+    }
+
+    // stops the workers once their current task finished and returns the
+    // queued tasks which never ran, destroying them breaks their promises.
+    // Later dispatches are rejected (continuations are dropped)
+    std::vector<UniqueFunction<void()>> shutdownNow() {
+        this->_checkExternal();
+        this->_stop();
+        auto tasks = this->_takeQueued();
+        if (auto* lane = this->m_BlockingLane.load())
+            for (auto& e : lane->shutdownNow())
+                tasks.push_back(std::move(e));
+        return tasks;
     }
 
     template <typename _PType, typename _Function, typename... _Args>
     auto dispatchWork(_PType&& priority, _Function&& function, _Args&&... args)
         -> typename std::enable_if<
             !std::is_same<decltype(function(args...)), void>::value,
-            std::future<decltype(function(args...))>>::type {
-        auto task =
-            std::make_shared<std::packaged_task<decltype(function(args...))()>>(
-                std::bind(std::forward<_Function>(function),
-                          std::forward<_Args>(args)...));
-        auto future = task->get_future();
-        this->_dispatch(std::forward<_PType>(priority), [task] { (*task)(); });
-        return future;
+            Future<decltype(function(args...))>>::type {
+        auto future = this->_dispatchFuture(
+            _Submit::Dispatch, std::forward<_PType>(priority),
+            std::forward<_Function>(function), std::forward<_Args>(args)...);
+        if (!future)
+            _throwRejected();
+        return std::move(*future);
     }
     template <typename _PType, typename _Function, typename... _Args>
     auto dispatchWork(_PType&& priority, _Function&& function, _Args&&... args)
         -> typename std::enable_if<
             std::is_same<decltype(function(args...)), void>::value,
             void>::type {
-        this->_dispatch(std::forward<_PType>(priority),
-                        std::bind(std::forward<_Function>(function),
-                                  std::forward<_Args>(args)...));
+        if (!this->_dispatch(_Submit::Dispatch, std::forward<_PType>(priority),
+                             _bind(std::forward<_Function>(function),
+                                   std::forward<_Args>(args)...)))
+            _throwRejected();
     }
 
     template <typename _Function, typename... _Args>
     auto dispatchWork(_Function&& function, _Args&&... args) ->
         typename std::enable_if<
             !std::is_same<decltype(function(args...)), void>::value,
-            std::future<decltype(function(args...))>>::type {
+            Future<decltype(function(args...))>>::type {
         return this->dispatchWork(_PriorityType(),
                                   std::forward<_Function>(function),
                                   std::forward<_Args>(args)...);
@@ -80,32 +295,1221 @@ struct ThreadPool final {
                            std::forward<_Args>(args)...);
     }
 
+    // like dispatchWork, but the task is skipped if the token was stopped
+    // before it started, its future then holds TaskCancelled. The function
+    // may take the token as its first argument to poll it while running.
+    // Tasks sharing one std::stop_source are cancelled all at once
+    template <typename _PType, typename _Function, typename... _Args>
+    auto dispatchCancellable(std::stop_token token, _PType&& priority,
+                             _Function&& function, _Args&&... args)
+        -> threadpool_detail::CancellableDispatch<_Function, _Args...> {
+        using _Result =
+            threadpool_detail::CancellableResult<_Function, _Args...>;
+        return this->dispatchWork(
+            std::forward<_PType>(priority),
+            [token = std::move(token),
+             function = std::forward<_Function>(function),
+             args = std::make_tuple(std::forward<_Args>(args)...)]() mutable
+            -> _Result {
+                if (token.stop_requested()) {
+                    if constexpr (std::is_void_v<_Result>)
+                        return;
+                    else
+                        throw TaskCancelled();
+                }
+                return std::apply(
+                    [&](auto&... args) -> _Result {
+                        return threadpool_detail::invokeWithToken(
+                            function, token, args...);
+                    },
+                    args);
+            });
+    }
+    template <typename _Function, typename... _Args>
+    auto dispatchCancellable(std::stop_token token, _Function&& function,
+                             _Args&&... args)
+        -> threadpool_detail::CancellableDispatch<_Function, _Args...> {
+        return this->dispatchCancellable(
+            std::move(token), _PriorityType(),
+            std::forward<_Function>(function), std::forward<_Args>(args)...);
+    }
+
+    // like dispatchWork, but fails fast instead of applying the overflow
+    // policy: returns false (or an empty optional instead of the future) if
+    // the queue is full
+    template <typename _PType, typename _Function, typename... _Args>
+    auto tryDispatchWork(_PType&& priority, _Function&& function,
+                         _Args&&... args)
+        -> typename std::enable_if<
+            !std::is_same<decltype(function(args...)), void>::value,
+            std::optional<Future<decltype(function(args...))>>>::type {
+        return this->_dispatchFuture(
+            _Submit::Try, std::forward<_PType>(priority),
+            std::forward<_Function>(function), std::forward<_Args>(args)...);
+    }
+    template <typename _PType, typename _Function, typename... _Args>
+    auto tryDispatchWork(_PType&& priority, _Function&& function,
+                         _Args&&... args)
+        -> typename std::enable_if<
+            std::is_same<decltype(function(args...)), void>::value,
+            bool>::type {
+        return this->_dispatch(_Submit::Try, std::forward<_PType>(priority),
+                               _bind(std::forward<_Function>(function),
+                                     std::forward<_Args>(args)...));
+    }
+
+    template <typename _Function, typename... _Args>
+    auto tryDispatchWork(_Function&& function, _Args&&... args) ->
+        typename std::enable_if<
+            !std::is_same<decltype(function(args...)), void>::value,
+            std::optional<Future<decltype(function(args...))>>>::type {
+        return this->tryDispatchWork(_PriorityType(),
+                                     std::forward<_Function>(function),
+                                     std::forward<_Args>(args)...);
+    }
+    template <typename _Function, typename... _Args>
+    auto tryDispatchWork(_Function&& function, _Args&&... args) ->
+        typename std::enable_if<
+            std::is_same<decltype(function(args...)), void>::value,
+            bool>::type {
+        return this->tryDispatchWork(_PriorityType(),
+                                     std::forward<_Function>(function),
+                                     std::forward<_Args>(args)...);
+    }
+
+    // dispatches function(*it) for every element of [first, last) under a
+    // single lock acquisition (task by task if the pool has a capacity or
+    // watermarks), the elements are copied into the tasks. Returns a future
+    // per element, or for void functions one future which becomes ready
+    // once the whole batch finished (holding the first thrown exception, or
+    // a broken_promise if the pool shut down before running every task)
+    template <typename _PType, typename _Iterator, typename _Function>
+    auto dispatchBulk(_PType&& priority, _Iterator first, _Iterator last,
+                      _Function&& function) {
+        using _Result = decltype(function(*first));
+        using _Element = std::decay_t<decltype(*first)>;
+        const size_t count = std::distance(first, last);
+
+        using _State = _BulkState<std::decay_t<_Function>, _Result>;
+        auto* state = new _State(std::forward<_Function>(function), count,
+                                 this->m_FutureExecutor);
+        auto result = state->initialResult();
+        std::vector<_Work> batch;
+        batch.reserve(count);
+        for (; first != last; ++first) {
+            if constexpr (std::is_void_v<_Result>)
+                batch.emplace_back(priority,
+                                   [ticket = typename _State::Ticket(state),
+                                    element = _Element(*first)]() mutable {
+                                       ticket.take()->run(element);
+                                   });
+            else
+                batch.emplace_back(
+                    priority, [ticket = typename _State::Ticket(state),
+                               element = _Element(*first),
+                               promise = state->promise(result)]() mutable {
+                        ticket.take()->run(element, promise);
+                    });
+        }
+        if (batch.empty())
+            state->finishEmpty();
+        this->_dispatchBatch(batch);
+        return result;
+    }
+    template <typename _Iterator, typename _Function>
+    auto dispatchBulk(_Iterator first, _Iterator last, _Function&& function) {
+        return this->dispatchBulk(_PriorityType(), first, last,
+                                  std::forward<_Function>(function));
+    }
+
+    // dispatches the function once the delay elapsed, or at the given time.
+    // Timers are kept in a heap served by one timer thread (started on
+    // first use), arming and cancelling them is cheap. Results are
+    // discarded, pending timers are dropped when the pool shuts down
+    template <typename _Rep, typename _Period, typename _Function,
+              typename... _Args>
+    TimerHandle dispatchAfter(const std::chrono::duration<_Rep, _Period>& delay,
+                              _Function&& function, _Args&&... args) {
+        return this->m_Timers.arm(
+            _TimerClock::now() +
+                std::chrono::ceil<_TimerClock::duration>(delay),
+            {}, _discard(std::forward<_Function>(function),
+                         std::forward<_Args>(args)...));
+    }
+    template <typename _Clock, typename _Duration, typename _Function,
+              typename... _Args>
+    TimerHandle dispatchAt(const std::chrono::time_point<_Clock, _Duration>& time,
+                           _Function&& function, _Args&&... args) {
+        return this->dispatchAfter(time - _Clock::now(),
+                                   std::forward<_Function>(function),
+                                   std::forward<_Args>(args)...);
+    }
+    // dispatches the function every period (first after one period), a run
+    // is skipped while the previous one is still queued or running
+    template <typename _Rep, typename _Period, typename _Function,
+              typename... _Args>
+    TimerHandle dispatchEvery(const std::chrono::duration<_Rep, _Period>& period,
+                              _Function&& function, _Args&&... args) {
+        const auto interval = std::max(
+            std::chrono::ceil<_TimerClock::duration>(period),
+            _TimerClock::duration(1));
+        return this->m_Timers.arm(
+            _TimerClock::now() + interval, interval,
+            _discard(std::forward<_Function>(function),
+                     std::forward<_Args>(args)...));
+    }
+
+    // dispatches an already type erased task with the default priority, this
+    // makes the pool usable as an Executor for continuations
+    void post(UniqueFunction<void()> task) {
+        this->_dispatch(_Submit::Internal, _PriorityType(), std::move(task));
+    }
+
+    // co_await pool.schedule() suspends the coroutine and resumes it on a
+    // worker, see coroutine.hpp
+    auto schedule(_PriorityType priority = _PriorityType()) {
+        return _ScheduleAwaitable{this, std::move(priority)};
+    }
+
+    // runs one queued task on the calling thread, returns false if there was
+    // none. Lets waiting threads help instead of idling
+    bool tryRunPendingTask() {
+        _Work work;
+        if (!this->_tryAcquire(this->_callingWorker(), work))
+            return false;
+        this->_run(work);
+        return true;
+    }
+
+    // dispatches to the blocking lane: a separate elastic set of threads for
+    // tasks which block on I/O, so they don't occupy the cpu workers. The
+    // lane spawns a thread whenever all of its threads are busy (up to
+    // maxBlockingThreads) and retires them after idleTimeout. Same overloads
+    // as dispatchWork, continuations of the returned futures run on this
+    // pool, not on the blocking threads
+    template <typename... _Args>
+    decltype(auto) dispatchBlocking(_Args&&... args) {
+        return this->_blockingLane().dispatchWork(
+            std::forward<_Args>(args)...);
+    }
+
+    // runs a blocking function(args...) and returns its result. Called from
+    // a worker it's handed to the blocking lane while the worker keeps
+    // running cpu tasks until the result is there, other threads run it
+    // right away
+    template <typename _Function, typename... _Args>
+    auto blockInPlace(_Function&& function, _Args&&... args)
+        -> decltype(function(args...)) {
+        if (!this->isWorkerThread())
+            return std::forward<_Function>(function)(
+                std::forward<_Args>(args)...);
+        auto future = this->_blockingLane()._dispatchFuture(
+            _Submit::Internal, _PriorityType(),
+            std::forward<_Function>(function), std::forward<_Args>(args)...);
+        if (!future)
+            _throwRejected();
+        this->wait(*future);
+        return future->get();
+    }
+
+    // true if called from one of the pool's workers (or a task it runs)
+    bool isWorkerThread() const { return this->_callingWorker() != nullptr; }
+
+    // waits for the future (a Future or std::future) and executes queued
+    // work on the calling thread in the meantime. A task waiting for its own
+    // sub tasks keeps its worker busy instead of blocking it, which can't
+    // deadlock even a single threaded pool
+    template <typename _Future> void wait(const _Future& future) {
+        using namespace std::chrono_literals;
+        while (future.wait_for(0s) != std::future_status::ready)
+            if (!this->tryRunPendingTask())
+                // the awaited work runs elsewhere, recheck the queue from
+                // time to time, it may spawn more work
+                future.wait_for(100us);
+    }
+
+    // grows or shrinks the pool to numThreads workers, safe while tasks are
+    // running (even from inside a task). Retiring workers finish their
+    // current task and hand their queued work over to the others, they are
+    // joined lazily when their slot is reused or the pool is destroyed
+    void resize(size_t numThreads) {
+        if (numThreads > this->m_Workers.size())
+            throw std::out_of_range("ThreadPool: resize exceeds maxThreads");
+        {
+            std::lock_guard lock(this->m_Mutex);
+            if (this->m_Stop)
+                return;
+            for (auto& e : this->m_Workers) {
+                if (this->m_NumThreads >= numThreads)
+                    break;
+                if (e->running && e->retire)
+                    this->_unretireWorker(*e);
+            }
+            for (auto& e : this->m_Workers) {
+                if (this->m_NumThreads >= numThreads)
+                    break;
+                if (!e->running)
+                    this->_startWorker(*e);
+            }
+            for (auto it = this->m_Workers.rbegin();
+                 this->m_NumThreads > numThreads; ++it)
+                if ((*it)->running && !(*it)->retire)
+                    this->_retireWorker(**it);
+        }
+        this->m_ConditionVariable.notify_all();
+    }
+
+    size_t numThreads() const { return this->m_NumThreads.load(); }
+
+    // snapshot of the instrumentation, see metrics.hpp. Only the queue depth
+    // is filled in unless compiled with THREADPOOL_METRICS
+    ThreadPoolStats<_PriorityType> stats() const {
+        ThreadPoolStats<_PriorityType> stats;
+        stats.queueDepth =
+            size_t(std::max<ptrdiff_t>(this->m_Pending.load(), 0));
+#if THREADPOOL_METRICS
+        stats.external = this->m_ExternalMetrics.stats();
+        for (auto& e : this->m_Workers)
+            stats.workers.push_back(e->metrics.stats());
+        stats.maxQueueDepth = this->m_DepthSampler.max();
+        stats.queueDepthHistory = this->m_DepthSampler.history();
+
+        const size_t numLevels =
+            std::is_arithmetic_v<_PriorityType> ? s_MetricLevels : 1;
+        for (size_t level = 0; level < numLevels; ++level) {
+            typename ThreadPoolStats<_PriorityType>::Priority priority{
+                _metricPriority(level), {}, {}};
+            const auto add = [&](const threadpool_detail::WorkerMetrics& m) {
+                priority.wait += m.wait[level];
+                priority.run += m.run[level];
+            };
+            add(this->m_ExternalMetrics);
+            for (auto& e : this->m_Workers)
+                add(e->metrics);
+            if (priority.run.count())
+                stats.priorities.push_back(std::move(priority));
+        }
+#endif
+        return stats;
+    }
+
+    // writes the task events recorded so far as Chrome trace JSON (see
+    // trace.hpp), one track per worker. Safe while the pool is running,
+    // without THREADPOOL_TRACING the trace is empty
+    void writeChromeTrace(std::ostream& stream) const {
+        std::vector<std::vector<threadpool_detail::TraceRing::Event>> threads;
+#if THREADPOOL_TRACING
+        for (auto& e : this->m_Workers) {
+            // slots which never had a thread have no ring
+            threads.emplace_back();
+            if (const auto* trace = e->trace.load(std::memory_order_acquire))
+                threads.back() = trace->events();
+        }
+#endif
+        threadpool_detail::writeChromeTrace(stream, threads);
+    }
+
   private:
+#if THREADPOOL_TRACING
+    int64_t _traceTime(std::chrono::steady_clock::time_point time) const {
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(
+                   time - this->m_TraceEpoch)
+            .count();
+    }
+    static double _tracePriority(const _PriorityType& priority) {
+        if constexpr (std::is_arithmetic_v<_PriorityType>)
+            return double(priority);
+        else
+            return std::nan("");
+    }
+#endif
+#if THREADPOOL_METRICS
+    static constexpr size_t s_MetricLevels = threadpool_detail::s_MetricLevels;
+    using _MetricLevels =
+        threadpool_detail::PriorityLevels<s_MetricLevels, _PriorityType,
+                                          _Compare>;
+    static size_t _metricLevel(const _PriorityType& priority) {
+        if constexpr (std::is_arithmetic_v<_PriorityType>)
+            return _MetricLevels::rank(priority);
+        else
+            return 0;
+    }
+    static _PriorityType _metricPriority(size_t level) {
+        if constexpr (std::is_arithmetic_v<_PriorityType>)
+            return _MetricLevels::priority(level);
+        else
+            return _PriorityType();
+    }
+#endif
+
+    // like std::bind: the arguments are decay copied and passed as lvalues,
+    // without bind's extra layer of indirection
+    template <typename _Function, typename... _Args>
+    static auto _bind(_Function&& function, _Args&&... args) {
+        return [function = std::forward<_Function>(function),
+                args = std::make_tuple(std::forward<_Args>(args)...)]() mutable
+               -> decltype(auto) { return std::apply(function, args); };
+    }
+
+    using _TimerClock = threadpool_detail::TimerQueue::Clock;
+    template <typename _Function, typename... _Args>
+    static auto _discard(_Function&& function, _Args&&... args) {
+        return [bound = _bind(std::forward<_Function>(function),
+                              std::forward<_Args>(args)...)]() mutable {
+            bound();
+        };
+    }
+
+    struct _ScheduleAwaitable {
+        bool await_ready() const noexcept { return false; }
+        template <typename _Handle> void await_suspend(_Handle handle) {
+            // the coroutine may be destroyed before this returns
+            this->pool->_dispatch(_Submit::Internal, std::move(this->priority),
+                                  threadpool_detail::Resumer(handle));
+        }
+        void await_resume() const noexcept {}
+
+        ThreadPool* pool;
+        _PriorityType priority;
+    };
+
+    // shared by all tasks of a dispatchBulk call, the last one deletes it
+    template <typename _Function, typename _Result> struct _BulkState {
+        // held by every task of the batch: a task dropped without running
+        // (the pool shut down) still counts as finished, breaking the batch
+        // future instead of leaking the state
+        class Ticket {
+          public:
+            explicit Ticket(_BulkState* state) : m_State(state) {}
+            Ticket(Ticket&& rhs) noexcept
+                : m_State(std::exchange(rhs.m_State, nullptr)) {}
+            Ticket& operator=(Ticket&&) = delete;
+            ~Ticket() {
+                if (this->m_State)
+                    this->m_State->_drop();
+            }
+
+            _BulkState* take() {
+                return std::exchange(this->m_State, nullptr);
+            }
+
+          private:
+            _BulkState* m_State;
+        };
+
+        // continuations of the futures are posted to the executor, like
+        // those of dispatchWork
+        template <typename _Foo>
+        _BulkState(_Foo&& foo, size_t count, Executor exec)
+            : function(std::forward<_Foo>(foo)), remaining(count),
+              executor(exec) {
+            if constexpr (std::is_void_v<_Result>)
+                this->aggregate.setExecutor(exec);
+        }
+
+        auto initialResult() {
+            if constexpr (std::is_void_v<_Result>)
+                return this->aggregate.getFuture();
+            else {
+                std::vector<Future<_Result>> futures;
+                futures.reserve(this->remaining.load());
+                return futures;
+            }
+        }
+        Promise<_Result> promise(std::vector<Future<_Result>>& futures) {
+            Promise<_Result> promise;
+            promise.setExecutor(this->executor);
+            futures.push_back(promise.getFuture());
+            return promise;
+        }
+
+        template <typename _Element> void run(_Element& element) {
+            try {
+                this->function(element);
+            } catch (...) {
+                if (!this->failed.exchange(true))
+                    this->exception = std::current_exception();
+            }
+            this->_finishOne();
+        }
+        template <typename _Element>
+        void run(_Element& element, Promise<_Result>& promise) {
+            promise.setValueFrom([&] { return this->function(element); });
+            this->_finishOne();
+        }
+        void finishEmpty() {
+            if constexpr (std::is_void_v<_Result>)
+                this->aggregate.setValue();
+            delete this;
+        }
+
+        _Function function;
+        std::atomic<size_t> remaining;
+        const Executor executor;
+        std::atomic<bool> failed = false;
+        std::exception_ptr exception;
+        std::conditional_t<std::is_void_v<_Result>, Promise<void>,
+                           std::nullptr_t>
+            aggregate;
+
+      private:
+        // the task's own promise (if any) breaks when it is destroyed
+        void _drop() {
+            if (!this->failed.exchange(true))
+                this->exception = std::make_exception_ptr(
+                    std::future_error(std::future_errc::broken_promise));
+            this->_finishOne();
+        }
+        void _finishOne() {
+            if (this->remaining.fetch_sub(1, std::memory_order_acq_rel) != 1)
+                return;
+            if constexpr (std::is_void_v<_Result>) {
+                if (this->exception)
+                    this->aggregate.setException(this->exception);
+                else
+                    this->aggregate.setValue();
+            }
+            delete this;
+        }
+    };
+
     struct _Work {
         _PriorityType priority;
-        std::function<void()> function;
+        UniqueFunction<void()> function;
+#if THREADPOOL_METRICS
+        std::chrono::steady_clock::time_point enqueued =
+            std::chrono::steady_clock::now();
+#endif
+#if THREADPOOL_TRACING
+        const char* name = threadpool_detail::s_TraceName;
+#endif
 
+        _Work() = default;
         template <typename _PType, typename _Function>
         _Work(_PType&& prio, _Function&& foo)
             : priority(std::forward<_PType>(prio)),
               function(std::forward<_Function>(foo)) {}
+    };
+    using _Queue = typename _QueuePolicy::template Queue<_Work, _Compare>;
 
-        bool operator<(const _Work& rhs) const {
-            static _Compare cmp;
-            return cmp(this->priority, rhs.priority);
-        }
+    struct _Worker {
+        _Worker(size_t idx, size_t spin) : index(idx), spinLimit(spin) {}
+
+        size_t index;
+        // current adaptive spin period, only touched by the worker itself
+        size_t spinLimit;
+        // shard to drain next
+        size_t shardCursor = 0;
+        // NUMA node, cpus to run on (empty: any) and the workers to steal
+        // from, own node first
+        size_t node = 0;
+        std::vector<size_t> cpus;
+        std::vector<_Worker*> victims;
+        // lifetime of the slot's thread, guarded by m_Mutex
+        bool running = false;
+        std::atomic<bool> retire = false;
+        std::thread thread;
+        // only allocated with work stealing, a queue can be large
+        std::unique_ptr<_Queue> queue;
+#if THREADPOOL_METRICS
+        threadpool_detail::WorkerMetrics metrics;
+#endif
+#if THREADPOOL_TRACING
+        // allocated when the slot's first thread starts, read by
+        // writeChromeTrace while the pool runs
+        std::unique_ptr<threadpool_detail::TraceRing> traceOwner;
+        std::atomic<threadpool_detail::TraceRing*> trace = nullptr;
+#endif
     };
+
+    // both expect m_Mutex to be locked
+    void _startWorker(_Worker& worker) {
+        // the previous thread of the slot already left its loop
+        if (worker.thread.joinable())
+            worker.thread.join();
+        worker.running = true;
+        worker.retire = false;
+        worker.spinLimit = this->m_SpinIterations;
+#if THREADPOOL_METRICS
+        // a reused slot doesn't count the time without a thread as idle
+        worker.metrics.lastFinish = std::chrono::steady_clock::now();
+#endif
+#if THREADPOOL_TRACING
+        if (!worker.traceOwner) {
+            worker.traceOwner = std::make_unique<threadpool_detail::TraceRing>(
+                this->m_TraceBufferSize);
+            worker.trace.store(worker.traceOwner.get(),
+                               std::memory_order_release);
+        }
+#endif
+        this->m_NumThreads.fetch_add(1);
+        worker.thread = std::thread([this, &worker] {
+            this->_workerFunction(worker);
+        });
+    }
+    void _retireWorker(_Worker& worker) {
+        worker.retire = true;
+        this->m_NumThreads.fetch_sub(1);
+    }
+    // a retiring worker still in its loop (inside its last task, say)
+    // keeps its slot, it is taken back instead of starting another thread
+    void _unretireWorker(_Worker& worker) {
+        worker.retire = false;
+        this->m_NumThreads.fetch_add(1);
+    }
+
+    // splits the workers over the nodes and cpus and sets up one shared
+    // queue per node
+    void _placeWorkers(const ThreadPoolOptions& options) {
+        auto nodes = options.numaAware
+                         ? threadpool_detail::numaNodes()
+                         : std::vector<std::vector<size_t>>{options.cpuSet};
+        if (options.numaAware && !options.cpuSet.empty()) {
+            for (auto& e : nodes)
+                std::erase_if(e, [&](size_t cpu) {
+                    return std::find(options.cpuSet.begin(),
+                                     options.cpuSet.end(),
+                                     cpu) == options.cpuSet.end();
+                });
+            std::erase_if(nodes, [](const auto& e) { return e.empty(); });
+            if (nodes.empty())
+                throw std::invalid_argument(
+                    "ThreadPool: cpu set doesn't match any NUMA node");
+        }
+        if (options.pinWorkers && nodes.front().empty())
+            nodes.front() = threadpool_detail::allowedCpus();
+
+        for (size_t i = 0; i < nodes.size(); ++i) {
+            this->m_Queues.push_back(std::make_unique<_Queue>());
+            for (const size_t cpu : nodes[i]) {
+                if (cpu >= this->m_CpuNodes.size())
+                    this->m_CpuNodes.resize(cpu + 1, 0);
+                this->m_CpuNodes[cpu] = i;
+            }
+        }
+        for (auto& e : this->m_Workers) {
+            e->node = e->index % nodes.size();
+            const auto& cpus = nodes[e->node];
+            if (options.pinWorkers)
+                e->cpus = {cpus[e->index / nodes.size() % cpus.size()]};
+            else
+                e->cpus = cpus;
+        }
+        for (auto& e : this->m_Workers) {
+            const size_t numWorkers = this->m_Workers.size();
+            for (size_t i = 1; i < numWorkers; ++i)
+                e->victims.push_back(
+                    this->m_Workers[(e->index + i) % numWorkers].get());
+            std::stable_partition(
+                e->victims.begin(), e->victims.end(),
+                [&](const _Worker* victim) { return victim->node == e->node; });
+        }
+    }
+
+    void _workerFunction(_Worker& self) {
+        s_CurrentPool = this;
+        s_CurrentWorker = &self;
+        // placement is best effort, the thread keeps running anywhere if the
+        // cpus aren't available to the process
+        if (!self.cpus.empty())
+            threadpool_detail::setCurrentThreadAffinity(self.cpus);
+
+        _Work work;
+        while (true) {
+            this->_workerLoop(self, work);
+            if (this->m_Stop.load(std::memory_order_relaxed))
+                return;
+
+            // hand the local queue over, its work stays pending
+            size_t handedOver = 0;
+            auto& shared = this->_sharedQueue(&self);
+            while (self.queue && self.queue->pop(work)) {
+                if (shared.push(work))
+                    ++handedOver;
+                else {
+                    this->_acquired();
+                    this->_run(work);
+                }
+            }
+            this->_wake(handedOver);
+            // resize may have taken the retirement back meanwhile, the slot
+            // is only given up under the lock
+            std::lock_guard lock(this->m_Mutex);
+            if (self.retire) {
+                self.running = false;
+                return;
+            }
+        }
+    }
+    // runs tasks until the worker is retired or the pool stopped
+    void _workerLoop(_Worker& self, _Work& work) {
+        while (!self.retire.load(std::memory_order_relaxed)) {
+            if (this->m_Stop.load(std::memory_order_relaxed))
+                return;
+            if (this->_tryAcquire(&self, work)) {
+                this->_run(work);
+                continue;
+            }
+            if (this->_awaitWork(self))
+                continue;
+            std::unique_lock lock(this->m_Mutex);
+            const auto ready = [this, &self] {
+                return this->m_Stop || self.retire ||
+                       this->m_Pending.load() > 0;
+            };
+            this->m_Sleeping.fetch_add(1);
+            bool woken = true;
+            if (this->m_Elastic)
+                woken = this->m_ConditionVariable.wait_for(
+                    lock, this->m_IdleTimeout, ready);
+            else
+                this->m_ConditionVariable.wait(lock, ready);
+            this->m_Sleeping.fetch_sub(1);
+            if (this->m_Stop)
+                return;
+            if (!woken && this->m_NumThreads > this->m_MinThreads)
+                this->_retireWorker(self);
+        }
+    }
+
+    // new work often arrives within microseconds, spinning and yielding
+    // avoid the cost of parking and being woken up again. Dispatching
+    // doesn't notify while workers are spinning, they see the pending
+    // counter: it is raised before m_Spinning is read by _wake and checked
+    // again before parking
+    bool _awaitWork(_Worker& self) {
+        const auto hasWork = [this] {
+            return this->m_Pending.load(std::memory_order_relaxed) > 0;
+        };
+        const bool spin =
+            this->m_Spinning.fetch_add(1) < this->m_MaxSpinners;
+        bool found = false, spun = false;
+        for (size_t i = 0; spin && i < self.spinLimit && !found; ++i) {
+            threadpool_detail::cpuRelax();
+            spun = found = hasWork();
+        }
+        for (size_t i = 0; i < this->m_YieldIterations && !found; ++i) {
+            std::this_thread::yield();
+            found = hasWork();
+        }
+        this->m_Spinning.fetch_sub(1);
+
+        if (!spin)
+            return found;
+        if (spun)
+            self.spinLimit = std::min(this->m_SpinIterations,
+                                      std::max<size_t>(self.spinLimit * 2, 1));
+        else if (!found)
+            self.spinLimit =
+                std::max(std::min(this->m_SpinIterations, s_MinSpinIterations),
+                         self.spinLimit / 2);
+        return found;
+    }
+
+    // order: own queue (unless the shared queue holds more important work),
+    // shared queue of the own node, submission shards, shared queues of the
+    // other nodes, then steal from the other workers (own node first)
+    bool _tryAcquire(_Worker* self, _Work& work) {
+        auto& shared = this->_sharedQueue(self);
+        if (self && this->m_WorkStealing && !self->queue->empty()) {
+            _PriorityType local, global;
+            const bool preferGlobal = shared.peek(global) &&
+                                      self->queue->peek(local) &&
+                                      _Compare()(local, global);
+            if ((preferGlobal && shared.pop(work)) || self->queue->pop(work))
+                return this->_acquired();
+        }
+        if (shared.pop(work) || this->_popShard(self, work))
+            return this->_acquired();
+        for (auto& e : this->m_Queues)
+            if (e.get() != &shared && e->pop(work))
+                return this->_acquired();
+        if (!this->m_WorkStealing)
+            return false;
+
+        if (self) {
+            for (auto* victim : self->victims)
+                if (victim->queue->pop(work)) {
+#if THREADPOOL_METRICS
+                    self->metrics.steals.fetch_add(1,
+                                                   std::memory_order_relaxed);
+#endif
+                    return this->_acquired();
+                }
+            return false;
+        }
+        for (auto& e : this->m_Workers)
+            if (e->queue->pop(work))
+                return this->_acquired();
+        return false;
+    }
+    // workers use their node's queue, other threads the queue of the node
+    // they currently run on
+    _Queue& _sharedQueue(_Worker* self) {
+        if (this->m_Queues.size() == 1)
+            return *this->m_Queues.front();
+        if (self)
+            return *this->m_Queues[self->node];
+        const int cpu = threadpool_detail::currentCpu();
+        if (cpu < 0 || size_t(cpu) >= this->m_CpuNodes.size())
+            return *this->m_Queues.front();
+        return *this->m_Queues[this->m_CpuNodes[cpu]];
+    }
+    _Worker* _callingWorker() const {
+        return s_CurrentPool == this ? s_CurrentWorker : nullptr;
+    }
+    // every worker continues after the shard it took work from last, so
+    // the shards are drained round robin
+    bool _popShard(_Worker* self, _Work& work) {
+        const size_t numShards = this->m_Shards.size();
+        const size_t start = self ? self->shardCursor : 0;
+        for (size_t i = 0; i < numShards; ++i) {
+            const size_t index = (start + i) % numShards;
+            if (this->m_Shards[index]->pop(work)) {
+                if (self)
+                    self->shardCursor = index + 1;
+                return true;
+            }
+        }
+        return false;
+    }
+    // runs queued work, drain() waits for the last one
+    void _run(_Work& work) {
+#if THREADPOOL_METRICS || THREADPOOL_TRACING
+        using _Clock = std::chrono::steady_clock;
+        _Worker* self = this->_callingWorker();
+        const auto start = _Clock::now();
+#endif
+#if THREADPOOL_METRICS
+        if (self) {
+            self->metrics.idle.fetch_add(
+                (start - self->metrics.lastFinish).count(),
+                std::memory_order_relaxed);
+            // a nested task (helping wait) isn't idle time
+            self->metrics.lastFinish = start;
+        }
+        this->m_DepthSampler.sample(
+            start, size_t(std::max<ptrdiff_t>(this->m_Pending.load(), 0)));
+#endif
+#if THREADPOOL_TRACING
+        // tasks dispatched by this one inherit its name
+        const TraceName name(work.name);
+#endif
+        work.function();
+        work.function = nullptr;
+#if THREADPOOL_METRICS || THREADPOOL_TRACING
+        const auto finish = _Clock::now();
+#endif
+#if THREADPOOL_METRICS
+        auto& metrics = self ? self->metrics : this->m_ExternalMetrics;
+        metrics.ran(_metricLevel(work.priority), work.enqueued, start, finish);
+        if (self)
+            self->metrics.lastFinish = finish;
+#endif
+#if THREADPOOL_TRACING
+        if (self)
+            self->trace.load(std::memory_order_relaxed)
+                ->record({work.name, _tracePriority(work.priority),
+                          this->_traceTime(start), this->_traceTime(finish)});
+#endif
+        this->_finished(1);
+    }
+    void _finished(size_t count) {
+        if (this->m_Unfinished.fetch_sub(count) != ptrdiff_t(count) ||
+            this->m_Draining.load() == 0)
+            return;
+        { std::lock_guard lock(this->m_Mutex); }
+        this->m_DrainedCondition.notify_all();
+    }
+    bool _drained() const {
+        return this->m_Stop || this->m_Unfinished.load() == 0;
+    }
+    bool _laneDrained() const {
+        const auto* lane = this->m_BlockingLane.load();
+        return this->_drained() && (!lane || lane->_drained());
+    }
+
+    // created on first use, without threads until blocking work arrives
+    ThreadPool& _blockingLane() {
+        if (auto* lane = this->m_BlockingLane.load(std::memory_order_acquire))
+            return *lane;
+        std::lock_guard lock(this->m_Mutex);
+        if (!this->m_BlockingLaneOwner) {
+            ThreadPoolOptions options;
+            options.numThreads = 0;
+            options.maxThreads =
+                std::max<size_t>(this->m_MaxBlockingThreads, 1);
+            options.elastic = true;
+            options.minThreads = 0;
+            options.idleTimeout = this->m_IdleTimeout;
+            options.cpuSet = this->m_CpuSet;
+#if THREADPOOL_TRACING
+            options.traceBufferSize = this->m_TraceBufferSize;
+#endif
+            // its threads block instead of spinning for work
+            options.spinIterations = options.yieldIterations = 0;
+            this->m_BlockingLaneOwner = std::make_unique<ThreadPool>(options);
+            this->m_BlockingLaneOwner->m_GrowEagerly = true;
+            this->m_BlockingLaneOwner->m_FutureExecutor = *this;
+            if (this->m_Stop)
+                this->m_BlockingLaneOwner->_stop();
+            this->m_BlockingLane.store(this->m_BlockingLaneOwner.get(),
+                                       std::memory_order_release);
+        }
+        return *this->m_BlockingLaneOwner;
+    }
+
+    void _checkExternal() const {
+        if (this->_callingWorker())
+            throw std::logic_error(
+                "ThreadPool: can't wait for the pool from one of its workers");
+    }
+    void _stop() {
+        this->m_Timers.stop();
+        {
+            std::lock_guard lock(this->m_Mutex);
+            this->m_Stop = true;
+        }
+        this->m_ConditionVariable.notify_all();
+        this->m_DrainedCondition.notify_all();
+        this->_notifyRoom(true);
+        for (auto& e : this->m_Workers)
+            if (e->thread.joinable())
+                e->thread.join();
+    }
+    // expects the workers to be stopped
+    std::vector<UniqueFunction<void()>> _takeQueued() {
+        std::vector<UniqueFunction<void()>> tasks;
+        _Work work;
+        const auto take = [&](_Queue& queue) {
+            while (queue.pop(work))
+                tasks.push_back(std::move(work.function));
+        };
+        for (auto& e : this->m_Queues)
+            take(*e);
+        for (auto& e : this->m_Shards)
+            take(*e);
+        for (auto& e : this->m_Workers)
+            if (e->queue)
+                take(*e->queue);
+        this->m_Pending.fetch_sub(tasks.size());
+        this->_notifyRoom(true);
+        this->_finished(tasks.size());
+        return tasks;
+    }
+    // wakes producers blocked on a full queue (after making room or
+    // stopping), they wait for the generation to change
+    void _notifyRoom(bool all) {
+        this->m_RoomGeneration.fetch_add(1);
+        if (all)
+            this->m_RoomGeneration.notify_all();
+        else
+            this->m_RoomGeneration.notify_one();
+    }
+
+    bool _acquired() {
+        const ptrdiff_t pending = this->m_Pending.fetch_sub(1) - 1;
+        if (this->m_Capacity && this->m_Blocked.load() > 0)
+            this->_notifyRoom(false);
+        if (this->m_AboveHighWatermark.load(std::memory_order_relaxed) &&
+            pending <= ptrdiff_t(this->m_LowWatermark) &&
+            this->m_AboveHighWatermark.exchange(false) &&
+            this->m_OnLowWatermark)
+            this->m_OnLowWatermark();
+        return true;
+    }
+
+    // how a full queue (see OverflowPolicy) is handled: Dispatch applies the
+    // policy, Try fails, Internal applies it but runs the work instead of
+    // rejecting it
+    enum class _Submit { Dispatch, Try, Internal };
+
+    [[noreturn]] static void _throwRejected() {
+        throw std::runtime_error("ThreadPool: queue is full or shut down");
+    }
+
+    template <typename _PType, typename _Function, typename... _Args>
+    auto _dispatchFuture(_Submit submit, _PType&& priority,
+                         _Function&& function, _Args&&... args)
+        -> std::optional<Future<decltype(function(args...))>> {
+        Promise<decltype(function(args...))> promise;
+        promise.setExecutor(this->m_FutureExecutor);
+        auto future = promise.getFuture();
+        if (!this->_dispatch(
+                submit, std::forward<_PType>(priority),
+                [promise = std::move(promise),
+                 bound = _bind(std::forward<_Function>(function),
+                               std::forward<_Args>(args)...)]() mutable {
+                    promise.setValueFrom(bound);
+                }))
+            return std::nullopt;
+        return future;
+    }
+    // false if the work was rejected
     template <typename _PType, typename _Function>
-    void _dispatch(_PType&& priority, _Function&& function) {
-        std::unique_lock lock(this->m_Mutex);
-        this->m_Queue.emplace(std::forward<_PType>(priority),
-                              std::forward<_Function>(function));
-        lock.unlock();
-        this->m_ConditionVariable.notify_one();
-    }
-    std::mutex m_Mutex;
-    bool m_Stop = false;
-    std::vector<std::thread> m_Threads;
-    std::priority_queue<_Work> m_Queue;
+    bool _dispatch(_Submit submit, _PType&& priority, _Function&& function) {
+        _Work work(std::forward<_PType>(priority),
+                   std::forward<_Function>(function));
+        return this->_submit(submit, work);
+    }
+    bool _submit(_Submit submit, _Work& work) {
+        // the counter is raised before the work gets visible, so a worker
+        // about to park can't miss it
+        if (this->m_Stop.load(std::memory_order_relaxed) ||
+            !this->_admit(submit)) {
+            // a stopped pool drops internal work, breaking its promise
+            if (this->m_Stop)
+                return submit == _Submit::Internal;
+            const bool reject =
+                submit == _Submit::Try ||
+                (submit == _Submit::Dispatch && !this->_callingWorker() &&
+                 this->m_Overflow == OverflowPolicy::Reject);
+            if (!reject)
+                work.function();
+            return !reject;
+        }
+        this->_checkHighWatermark();
+        if (!this->_push(work)) {
+            this->m_Pending.fetch_sub(1);
+            this->_overflow(work);
+            return true;
+        }
+        this->_wake(1);
+        return true;
+    }
+    // raises the pending counter for one more task, fails if the queue is
+    // at capacity and the caller shouldn't block: workers never do, waiting
+    // for room could deadlock the pool
+    bool _admit(_Submit submit) {
+        this->m_Unfinished.fetch_add(1);
+        if (!this->m_Capacity) {
+            this->m_Pending.fetch_add(1);
+            return true;
+        }
+        const bool block = submit != _Submit::Try &&
+                           this->m_Overflow == OverflowPolicy::Block &&
+                           !this->_callingWorker();
+        ptrdiff_t pending = this->m_Pending.load();
+        bool blocked = false;
+        while (true) {
+            if (pending < ptrdiff_t(this->m_Capacity)) {
+                if (!this->m_Pending.compare_exchange_weak(pending,
+                                                           pending + 1))
+                    continue;
+                // a producer woken by the shutdown doesn't push into the
+                // stopped pool
+                if (!blocked || !this->m_Stop)
+                    return true;
+                this->m_Pending.fetch_sub(1);
+                this->m_Unfinished.fetch_sub(1);
+                return false;
+            }
+            if (!block || this->m_Stop) {
+                this->m_Unfinished.fetch_sub(1);
+                return false;
+            }
+            // the counters are read again after the generation: room made
+            // (or the stop) in between changes it and the wait returns
+            this->m_Blocked.fetch_add(1);
+            const uint32_t generation = this->m_RoomGeneration.load();
+            if (this->m_Pending.load() >= ptrdiff_t(this->m_Capacity) &&
+                !this->m_Stop)
+                this->m_RoomGeneration.wait(generation);
+            this->m_Blocked.fetch_sub(1);
+            blocked = true;
+            pending = this->m_Pending.load();
+        }
+    }
+    void _checkHighWatermark() {
+        if (this->m_HighWatermark &&
+            this->m_Pending.load(std::memory_order_relaxed) >=
+                ptrdiff_t(this->m_HighWatermark) &&
+            !this->m_AboveHighWatermark.load(std::memory_order_relaxed) &&
+            !this->m_AboveHighWatermark.exchange(true) &&
+            this->m_OnHighWatermark)
+            this->m_OnHighWatermark();
+    }
+    void _dispatchBatch(std::vector<_Work>& batch) {
+        // a stopped pool drops the batch, like _submit drops internal work
+        if (batch.empty() || this->m_Stop.load(std::memory_order_relaxed)) {
+            batch.clear();
+            return;
+        }
+        // every task has to be admitted on its own, bulk dispatching never
+        // rejects
+        if (this->m_Capacity || this->m_HighWatermark) {
+            for (auto& e : batch)
+                this->_submit(_Submit::Internal, e);
+            return;
+        }
+        this->m_Unfinished.fetch_add(batch.size());
+        this->m_Pending.fetch_add(batch.size());
+        auto* first = batch.data();
+        auto* last = first + batch.size();
+        if (this->m_WorkStealing && s_CurrentPool == this)
+            first += s_CurrentWorker->queue->pushBulk(first, last);
+        if (!this->m_Shards.empty())
+            first += this->_producerShard().pushBulk(first, last);
+        first += this->_sharedQueue(this->_callingWorker())
+                     .pushBulk(first, last);
+        this->m_Pending.fetch_sub(last - first);
+        this->_wake(batch.size() - (last - first));
+        for (; first != last; ++first)
+            this->_overflow(*first);
+    }
+    // moves the work into the own (work stealing), the producer's shard or
+    // the shared queue, fails only if the bounded queues of the policy are
+    // full
+    bool _push(_Work& work) {
+        if (this->m_WorkStealing && s_CurrentPool == this &&
+            s_CurrentWorker->queue->push(work))
+            return true;
+        if (!this->m_Shards.empty() && this->_producerShard().push(work))
+            return true;
+        return this->_sharedQueue(this->_callingWorker()).push(work);
+    }
+    _Queue& _producerShard() {
+        return *this->m_Shards[s_ProducerIndex % this->m_Shards.size()];
+    }
+    // the queue is full: a worker runs the work itself, waiting for room
+    // could deadlock the pool, other threads wait until a worker made room
+    void _overflow(_Work& work) {
+        if (s_CurrentPool == this) {
+            this->_run(work);
+            return;
+        }
+        while (true) {
+            std::this_thread::yield();
+            if (this->m_Stop) {
+                this->_finished(1);
+                return;
+            }
+            this->m_Pending.fetch_add(1);
+            if (this->_sharedQueue(nullptr).push(work))
+                break;
+            this->m_Pending.fetch_sub(1);
+        }
+        this->_wake(1);
+    }
+    void _wake(size_t count) {
+        if (this->m_Elastic)
+            this->_grow();
+        // spinning workers pick the work up without a notification
+        const size_t spinning = this->m_Spinning.load();
+        if (count <= spinning)
+            return;
+        count -= spinning;
+        const size_t sleeping = this->m_Sleeping.load();
+        if (sleeping == 0)
+            return;
+        // synchronize with the predicate check of a worker about to park
+        { std::lock_guard lock(this->m_Mutex); }
+        if (count >= sleeping)
+            this->m_ConditionVariable.notify_all();
+        else
+            while (count--)
+                this->m_ConditionVariable.notify_one();
+    }
+
+    // elastic mode: one more worker if work queues up while no worker is
+    // idle
+    void _grow() {
+        const auto backlog = [this] {
+            return this->m_Sleeping.load() == 0 &&
+                   this->m_Spinning.load() == 0 &&
+                   this->m_NumThreads.load() < this->m_Workers.size() &&
+                   this->m_Pending.load() >=
+                       (this->m_GrowEagerly ? 1
+                                            : ptrdiff_t(this->m_NumThreads));
+        };
+        if (!backlog())
+            return;
+        std::lock_guard lock(this->m_Mutex);
+        if (this->m_Stop || !backlog())
+            return;
+        for (auto& e : this->m_Workers)
+            if (e->running && e->retire) {
+                this->_unretireWorker(*e);
+                return;
+            }
+        for (auto& e : this->m_Workers)
+            if (!e->running) {
+                this->_startWorker(*e);
+                return;
+            }
+    }
+
+    // the adaptive spin period never drops below this
+    static constexpr size_t s_MinSpinIterations = 32;
+    // spreads the producer threads over the submission shards
+    static inline std::atomic<size_t> s_NextProducerIndex = 0;
+    static inline thread_local const size_t s_ProducerIndex =
+        s_NextProducerIndex.fetch_add(1, std::memory_order_relaxed);
+    static inline thread_local ThreadPool* s_CurrentPool = nullptr;
+    static inline thread_local _Worker* s_CurrentWorker = nullptr;
+
+    const bool m_WorkStealing;
+    const size_t m_SpinIterations, m_YieldIterations;
+    // workers spinning at the same time, the rest only yield
+    const size_t m_MaxSpinners;
+    const bool m_Elastic;
+    const size_t m_MinThreads;
+    const std::chrono::milliseconds m_IdleTimeout;
+    const size_t m_Capacity;
+    const OverflowPolicy m_Overflow;
+    const size_t m_HighWatermark, m_LowWatermark;
+    const std::function<void()> m_OnHighWatermark, m_OnLowWatermark;
+    const size_t m_MaxBlockingThreads;
+    // passed on to the blocking lane
+    const std::vector<size_t> m_CpuSet;
+    // continuations of the futures of dispatched work run here: the pool
+    // itself, the parent pool for the blocking lane
+    Executor m_FutureExecutor = *this;
+    // blocking lane: its threads are busy blocking, not computing, a single
+    // queued task is enough to grow
+    bool m_GrowEagerly = false;
+    // every dispatch and every task modify the pending and unfinished
+    // counters, idle workers the spinning and sleeping ones: each group
+    // gets a cache line of its own, apart from the mutex and the mostly
+    // read state, so the writers don't invalidate each other's lines
+    alignas(threadpool_detail::s_CacheLineSize) std::mutex m_Mutex;
+    std::atomic<bool> m_Stop = false;
+    // running workers which aren't retiring
+    std::atomic<size_t> m_NumThreads = 0;
+    alignas(threadpool_detail::s_CacheLineSize) std::atomic<ptrdiff_t>
+        m_Pending = 0;
+    // producers waiting for room in a full queue, see _notifyRoom
+    std::atomic<size_t> m_Blocked = 0;
+    std::atomic<uint32_t> m_RoomGeneration = 0;
+    std::atomic<bool> m_AboveHighWatermark = false;
+    // admitted tasks which didn't finish yet, drain() waits for zero
+    alignas(threadpool_detail::s_CacheLineSize) std::atomic<ptrdiff_t>
+        m_Unfinished = 0;
+    std::atomic<size_t> m_Draining = 0;
+    alignas(threadpool_detail::s_CacheLineSize) std::atomic<size_t>
+        m_Spinning = 0;
+    std::atomic<size_t> m_Sleeping = 0;
+    // one slot per possible worker, the vector itself never changes
+    alignas(threadpool_detail::s_CacheLineSize)
+        std::vector<std::unique_ptr<_Worker>> m_Workers;
+    // one shared queue per NUMA node (just one if not NUMA aware)
+    std::vector<std::unique_ptr<_Queue>> m_Queues;
+    // node index of every cpu
+    std::vector<size_t> m_CpuNodes;
+    std::vector<std::unique_ptr<_Queue>> m_Shards;
     std::condition_variable m_ConditionVariable;
+    std::condition_variable m_DrainedCondition;
+#if THREADPOOL_TRACING
+    const std::chrono::steady_clock::time_point m_TraceEpoch =
+        std::chrono::steady_clock::now();
+    size_t m_TraceBufferSize = 0;
+#endif
+#if THREADPOOL_METRICS
+    // tasks run by threads other than the workers
+    threadpool_detail::WorkerMetrics m_ExternalMetrics;
+    threadpool_detail::DepthSampler m_DepthSampler;
+#endif
+    std::unique_ptr<ThreadPool> m_BlockingLaneOwner;
+    std::atomic<ThreadPool*> m_BlockingLane = nullptr;
+    threadpool_detail::TimerQueue m_Timers{Executor(*this)};
 };
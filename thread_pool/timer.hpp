@@ -0,0 +1,233 @@
+#pragma once
+#include "future.hpp"
+#include "uniquefunction.hpp"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace threadpool_detail {
+class TimerQueue;
+}
+
+// handle of a timer armed by ThreadPool::dispatchAfter/At/Every, it must not
+// be used after the pool was destroyed
+class TimerHandle final {
+  public:
+    TimerHandle() = default;
+
+    // false if the timer already fired (one shot timers) or was cancelled
+    // before. A run which was already dispatched isn't affected
+    bool cancel();
+
+  private:
+    friend class threadpool_detail::TimerQueue;
+    TimerHandle(threadpool_detail::TimerQueue* queue, uint32_t slot,
+                uint32_t generation)
+        : m_Queue(queue), m_Slot(slot), m_Generation(generation) {}
+
+    threadpool_detail::TimerQueue* m_Queue = nullptr;
+    uint32_t m_Slot = 0, m_Generation = 0;
+};
+
+namespace threadpool_detail {
+
+// min heap of due times served by one lazily started thread, which
+// dispatches the expired timers to the executor. Timers live in a slot
+// table, a handle names a slot and its generation: cancelling frees the slot
+// in O(1) and leaves a stale heap entry behind, which is skipped when it
+// comes up (or dropped when stale entries make up half of the heap)
+class TimerQueue final {
+  public:
+    using Clock = std::chrono::steady_clock;
+
+    explicit TimerQueue(Executor executor) : m_Executor(executor) {}
+    ~TimerQueue() { this->stop(); }
+
+    // period zero arms a one shot timer
+    TimerHandle arm(Clock::time_point due, Clock::duration period,
+                    UniqueFunction<void()> task) {
+        std::unique_lock lock(this->m_Mutex);
+        if (this->m_Stop)
+            return {};
+        if (!this->m_Thread.joinable())
+            this->m_Thread = std::thread([this] { this->_run(); });
+
+        uint32_t slot;
+        if (this->m_FreeSlots.empty()) {
+            slot = uint32_t(this->m_Slots.size());
+            this->m_Slots.emplace_back();
+        } else {
+            slot = this->m_FreeSlots.back();
+            this->m_FreeSlots.pop_back();
+        }
+        auto& timer = this->m_Slots[slot];
+        timer.armed = true;
+        timer.period = period;
+        if (period > Clock::duration::zero())
+            timer.periodic = std::make_shared<_Periodic>(std::move(task));
+        else
+            timer.task = std::move(task);
+        const uint32_t generation = timer.generation;
+
+        const bool earliest =
+            this->m_Heap.empty() || due < this->m_Heap.front().due;
+        this->m_Heap.push_back({due, slot, generation});
+        std::push_heap(this->m_Heap.begin(), this->m_Heap.end(), _later);
+        lock.unlock();
+        if (earliest)
+            this->m_Condition.notify_one();
+        return TimerHandle(this, slot, generation);
+    }
+
+    bool cancel(uint32_t slot, uint32_t generation) {
+        _Slot released;
+        {
+            std::lock_guard lock(this->m_Mutex);
+            if (slot >= this->m_Slots.size() ||
+                this->m_Slots[slot].generation != generation ||
+                !this->m_Slots[slot].armed)
+                return false;
+            released = this->_release(slot);
+            if (++this->m_Stale > s_MinCompaction &&
+                this->m_Stale > this->m_Heap.size() / 2)
+                this->_compact();
+        }
+        // the callbacks are destroyed outside of the lock
+        return true;
+    }
+
+    // stops the thread, timers which didn't fire are dropped
+    void stop() {
+        std::vector<_Slot> slots;
+        {
+            std::lock_guard lock(this->m_Mutex);
+            this->m_Stop = true;
+        }
+        this->m_Condition.notify_all();
+        if (this->m_Thread.joinable())
+            this->m_Thread.join();
+        std::lock_guard lock(this->m_Mutex);
+        slots.swap(this->m_Slots);
+        this->m_Heap.clear();
+        this->m_FreeSlots.clear();
+    }
+
+  private:
+    // a periodic timer skips its runs while the previous run is still
+    // queued or running
+    struct _Periodic {
+        _Periodic(UniqueFunction<void()>&& foo) : function(std::move(foo)) {}
+
+        UniqueFunction<void()> function;
+        std::atomic<bool> running = false;
+    };
+    struct _Slot {
+        uint32_t generation = 0;
+        bool armed = false;
+        Clock::duration period{};
+        UniqueFunction<void()> task;
+        std::shared_ptr<_Periodic> periodic;
+    };
+    struct _Entry {
+        Clock::time_point due;
+        uint32_t slot, generation;
+    };
+
+    static bool _later(const _Entry& lhs, const _Entry& rhs) {
+        return lhs.due > rhs.due;
+    }
+    bool _isStale(const _Entry& entry) const {
+        return this->m_Slots[entry.slot].generation != entry.generation;
+    }
+    // expects the lock, returns the callbacks so they can be destroyed
+    // after unlocking
+    _Slot _release(uint32_t slot) {
+        auto& timer = this->m_Slots[slot];
+        _Slot released;
+        released.task = std::move(timer.task);
+        released.periodic = std::move(timer.periodic);
+        ++timer.generation;
+        timer.armed = false;
+        this->m_FreeSlots.push_back(slot);
+        return released;
+    }
+    void _compact() {
+        std::erase_if(this->m_Heap,
+                      [this](const _Entry& e) { return this->_isStale(e); });
+        std::make_heap(this->m_Heap.begin(), this->m_Heap.end(), _later);
+        this->m_Stale = 0;
+    }
+
+    void _run() {
+        std::unique_lock lock(this->m_Mutex);
+        while (!this->m_Stop) {
+            if (this->m_Heap.empty()) {
+                this->m_Condition.wait(lock);
+                continue;
+            }
+            // copied, the heap may grow while waiting
+            const auto now = Clock::now(), due = this->m_Heap.front().due;
+            if (now < due) {
+                this->m_Condition.wait_until(lock, due);
+                continue;
+            }
+            std::pop_heap(this->m_Heap.begin(), this->m_Heap.end(), _later);
+            const _Entry entry = this->m_Heap.back();
+            this->m_Heap.pop_back();
+            if (this->_isStale(entry)) {
+                --this->m_Stale;
+                continue;
+            }
+
+            UniqueFunction<void()> task;
+            auto& timer = this->m_Slots[entry.slot];
+            if (timer.periodic) {
+                auto periodic = timer.periodic;
+                if (!periodic->running.exchange(true))
+                    task = [periodic] {
+                        periodic->function();
+                        periodic->running = false;
+                    };
+                // fixed rate, but a timer which fell behind doesn't burst
+                auto next = entry.due + timer.period;
+                if (next <= now)
+                    next = now + timer.period;
+                this->m_Heap.push_back({next, entry.slot, entry.generation});
+                std::push_heap(this->m_Heap.begin(), this->m_Heap.end(),
+                               _later);
+            } else
+                task = std::move(this->_release(entry.slot).task);
+            if (task) {
+                lock.unlock();
+                this->m_Executor.post(std::move(task));
+                lock.lock();
+            }
+        }
+    }
+
+    static constexpr size_t s_MinCompaction = 1024;
+
+    const Executor m_Executor;
+    std::mutex m_Mutex;
+    std::condition_variable m_Condition;
+    bool m_Stop = false;
+    std::vector<_Entry> m_Heap;
+    std::vector<_Slot> m_Slots;
+    std::vector<uint32_t> m_FreeSlots;
+    // heap entries of cancelled timers
+    size_t m_Stale = 0;
+    std::thread m_Thread;
+};
+
+} // namespace threadpool_detail
+
+inline bool TimerHandle::cancel() {
+    return this->m_Queue &&
+           this->m_Queue->cancel(this->m_Slot, this->m_Generation);
+}
@@ -0,0 +1,111 @@
+#pragma once
+#include <algorithm>
+#include <cstdlib>
+#include <filesystem>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#ifdef __linux__
+#include <sched.h>
+#endif
+
+// cpu placement helpers for ThreadPool. The NUMA layout is read from sysfs,
+// on other systems (or without sysfs) everything is one node and pinning is
+// a no-op
+namespace threadpool_detail {
+
+// parses a kernel cpu list like "0-3,8,10-11"
+inline std::vector<size_t> parseCpuList(const std::string& list) {
+    std::vector<size_t> cpus;
+    std::stringstream stream(list);
+    std::string range;
+    while (std::getline(stream, range, ',')) {
+        if (range.find_first_of("0123456789") == std::string::npos)
+            continue;
+        const size_t dash = range.find('-');
+        const size_t first = std::stoul(range.substr(0, dash));
+        const size_t last = dash == std::string::npos
+                                ? first
+                                : std::stoul(range.substr(dash + 1));
+        for (size_t cpu = first; cpu <= last; ++cpu)
+            cpus.push_back(cpu);
+    }
+    return cpus;
+}
+
+// cpus the process may run on
+inline std::vector<size_t> allowedCpus() {
+    std::vector<size_t> cpus;
+#ifdef __linux__
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    if (sched_getaffinity(0, sizeof(set), &set) == 0)
+        for (size_t cpu = 0; cpu < CPU_SETSIZE; ++cpu)
+            if (CPU_ISSET(cpu, &set))
+                cpus.push_back(cpu);
+#endif
+    if (cpus.empty())
+        for (size_t cpu = 0; cpu < std::thread::hardware_concurrency(); ++cpu)
+            cpus.push_back(cpu);
+    return cpus;
+}
+
+// cpus of every NUMA node, ordered by node id. Falls back to a single node
+// holding the allowed cpus if the directory doesn't describe any node
+inline std::vector<std::vector<size_t>>
+    numaNodes(const std::filesystem::path& root = "/sys/devices/system/node") {
+    std::vector<std::pair<size_t, std::vector<size_t>>> found;
+    std::error_code error;
+    for (const auto& e : std::filesystem::directory_iterator(root, error)) {
+        const std::string name = e.path().filename().string();
+        if (name.rfind("node", 0) != 0 ||
+            name.find_first_not_of("0123456789", 4) != std::string::npos ||
+            name.size() == 4)
+            continue;
+        std::ifstream file(e.path() / "cpulist");
+        std::string list;
+        if (!std::getline(file, list))
+            continue;
+        auto cpus = parseCpuList(list);
+        if (!cpus.empty())
+            found.emplace_back(std::stoul(name.substr(4)), std::move(cpus));
+    }
+    std::sort(found.begin(), found.end());
+
+    std::vector<std::vector<size_t>> nodes;
+    for (auto& e : found)
+        nodes.push_back(std::move(e.second));
+    if (nodes.empty())
+        nodes.push_back(allowedCpus());
+    return nodes;
+}
+
+// restricts the calling thread to the cpus, returns false if that failed
+// or isn't supported
+inline bool setCurrentThreadAffinity(const std::vector<size_t>& cpus) {
+#ifdef __linux__
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    for (const size_t cpu : cpus)
+        if (cpu < CPU_SETSIZE)
+            CPU_SET(cpu, &set);
+    return CPU_COUNT(&set) && sched_setaffinity(0, sizeof(set), &set) == 0;
+#else
+    (void)cpus;
+    return false;
+#endif
+}
+
+// cpu the calling thread runs on, -1 if unknown
+inline int currentCpu() {
+#ifdef __linux__
+    return sched_getcpu();
+#else
+    return -1;
+#endif
+}
+
+} // namespace threadpool_detail
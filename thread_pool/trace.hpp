@@ -0,0 +1,165 @@
+#pragma once
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <iomanip>
+#include <memory>
+#include <ostream>
+#include <string_view>
+#include <vector>
+
+// ThreadPool timeline tracing, compiled in with -DTHREADPOOL_TRACING=1.
+// Every worker records a begin/end event per task into its own ring buffer
+// (ThreadPoolOptions::traceBufferSize events, the oldest are overwritten),
+// ThreadPool::writeChromeTrace dumps them as Chrome trace JSON which
+// Perfetto and chrome://tracing open. Tasks run by other threads (helping
+// wait, caller runs) aren't traced
+#ifndef THREADPOOL_TRACING
+#define THREADPOOL_TRACING 0
+#endif
+
+namespace threadpool_detail {
+inline thread_local const char* s_TraceName = nullptr;
+}
+
+// names the tasks dispatched by the calling thread while it is alive. Tasks
+// dispatched from inside a task inherit its name. The name isn't copied, it
+// has to outlive the trace (a string literal usually)
+class TraceName final {
+  public:
+    explicit TraceName(const char* name)
+        : m_Previous(threadpool_detail::s_TraceName) {
+        threadpool_detail::s_TraceName = name;
+    }
+    ~TraceName() { threadpool_detail::s_TraceName = this->m_Previous; }
+    TraceName(const TraceName&) = delete;
+    TraceName& operator=(const TraceName&) = delete;
+
+  private:
+    const char* const m_Previous;
+};
+
+namespace threadpool_detail {
+
+// single producer ring of task events which can be read while the worker
+// keeps writing. The writer announces the index it is about to overwrite
+// before touching a slot, a reader drops every slot it copied which may
+// have been overwritten meanwhile (a seqlock per ring)
+class TraceRing final {
+  public:
+    struct Event {
+        const char* name;
+        // NaN for priorities which aren't arithmetic
+        double priority;
+        // nanoseconds since the pool was created
+        int64_t begin, end;
+    };
+
+    explicit TraceRing(size_t capacity)
+        : m_Capacity(capacity), m_Slots(new _Slot[capacity]) {}
+
+    void record(const Event& event) {
+        if (!this->m_Capacity)
+            return;
+        const uint64_t index = this->m_Written.load(std::memory_order_relaxed);
+        this->m_Writing.store(index + 1, std::memory_order_relaxed);
+        // release: a reader seeing any of the new values sees m_Writing too
+        auto& slot = this->m_Slots[index % this->m_Capacity];
+        slot.name.store(event.name, std::memory_order_release);
+        slot.priority.store(event.priority, std::memory_order_release);
+        slot.begin.store(event.begin, std::memory_order_release);
+        slot.end.store(event.end, std::memory_order_release);
+        this->m_Written.store(index + 1, std::memory_order_release);
+    }
+    // the events still in the ring, oldest first
+    std::vector<Event> events() const {
+        const uint64_t written =
+            this->m_Written.load(std::memory_order_acquire);
+        uint64_t first =
+            written > this->m_Capacity ? written - this->m_Capacity : 0;
+        std::vector<Event> events;
+        events.reserve(written - first);
+        for (uint64_t i = first; i < written; ++i) {
+            const auto& slot = this->m_Slots[i % this->m_Capacity];
+            events.push_back({slot.name.load(std::memory_order_acquire),
+                              slot.priority.load(std::memory_order_acquire),
+                              slot.begin.load(std::memory_order_acquire),
+                              slot.end.load(std::memory_order_acquire)});
+        }
+        const uint64_t writing =
+            this->m_Writing.load(std::memory_order_relaxed);
+        if (writing > this->m_Capacity && writing - this->m_Capacity > first)
+            events.erase(events.begin(),
+                         events.begin() +
+                             std::min<uint64_t>(
+                                 writing - this->m_Capacity - first,
+                                 events.size()));
+        return events;
+    }
+
+  private:
+    struct _Slot {
+        std::atomic<const char*> name = nullptr;
+        std::atomic<double> priority = 0.0;
+        std::atomic<int64_t> begin = 0, end = 0;
+    };
+
+    const size_t m_Capacity;
+    const std::unique_ptr<_Slot[]> m_Slots;
+    std::atomic<uint64_t> m_Written = 0, m_Writing = 0;
+};
+
+inline void writeJsonString(std::ostream& stream, std::string_view text) {
+    static constexpr char s_Hex[] = "0123456789abcdef";
+    stream << '"';
+    for (const char c : text) {
+        if (c == '"' || c == '\\')
+            stream << '\\' << c;
+        else if (static_cast<unsigned char>(c) < 0x20)
+            stream << "\\u00" << s_Hex[(c >> 4) & 0xf] << s_Hex[c & 0xf];
+        else
+            stream << c;
+    }
+    stream << '"';
+}
+
+// one complete ("X") event per task, timestamps in microseconds
+inline void writeChromeTrace(std::ostream& stream,
+                             const std::vector<std::vector<TraceRing::Event>>&
+                                 threads) {
+    const auto flags = stream.flags();
+    const auto precision = stream.precision();
+    stream << std::fixed << std::setprecision(3);
+    stream << "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[";
+    bool first = true;
+    const auto separate = [&] {
+        if (!first)
+            stream << ",\n";
+        first = false;
+    };
+    for (size_t tid = 0; tid < threads.size(); ++tid) {
+        if (threads[tid].empty())
+            continue;
+        separate();
+        stream << "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":"
+               << tid << ",\"args\":{\"name\":\"worker " << tid << "\"}}";
+        for (const auto& e : threads[tid]) {
+            separate();
+            stream << "{\"name\":";
+            writeJsonString(stream, e.name ? e.name : "task");
+            stream << ",\"ph\":\"X\",\"pid\":1,\"tid\":" << tid
+                   << ",\"ts\":" << e.begin / 1e3
+                   << ",\"dur\":" << (e.end - e.begin) / 1e3;
+            if (!std::isnan(e.priority))
+                stream << ",\"args\":{\"priority\":" << e.priority << '}';
+            stream << '}';
+        }
+    }
+    stream << "]}\n";
+    stream.flags(flags);
+    stream.precision(precision);
+}
+
+} // namespace threadpool_detail
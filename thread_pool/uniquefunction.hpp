@@ -0,0 +1,121 @@
+#pragma once
+#include <cstddef>
+#include <cstring>
+#include <new>
+#include <type_traits>
+#include <utility>
+
+template <typename _Signature,
+          size_t _BufferSize = 64 - sizeof(void*)> // one cache line
+class UniqueFunction;
+
+// move only replacement for std::function, callables up to _BufferSize bytes
+// (which are nothrow movable) are stored inline and never allocate
+template <typename _Ret, typename... _Args, size_t _BufferSize>
+class UniqueFunction<_Ret(_Args...), _BufferSize> final {
+  public:
+    UniqueFunction() = default;
+    UniqueFunction(std::nullptr_t) {}
+    template <typename _Function,
+              typename = std::enable_if_t<
+                  !std::is_same_v<std::decay_t<_Function>, UniqueFunction> &&
+                  std::is_invocable_r_v<_Ret, std::decay_t<_Function>&,
+                                        _Args...>>>
+    UniqueFunction(_Function&& function) {
+        using _Type = std::decay_t<_Function>;
+        if constexpr (_IsLocal<_Type>())
+            ::new (static_cast<void*>(this->m_Storage))
+                _Type(std::forward<_Function>(function));
+        else
+            *reinterpret_cast<_Type**>(this->m_Storage) =
+                new _Type(std::forward<_Function>(function));
+        this->m_VTable = &s_VTable<_Type>;
+    }
+    UniqueFunction(UniqueFunction&& rhs) noexcept { this->_moveFrom(rhs); }
+    UniqueFunction& operator=(UniqueFunction&& rhs) noexcept {
+        if (this != &rhs) {
+            this->_reset();
+            this->_moveFrom(rhs);
+        }
+        return *this;
+    }
+    UniqueFunction& operator=(std::nullptr_t) noexcept {
+        this->_reset();
+        return *this;
+    }
+    UniqueFunction(const UniqueFunction&) = delete;
+    UniqueFunction& operator=(const UniqueFunction&) = delete;
+    ~UniqueFunction() { this->_reset(); }
+
+    explicit operator bool() const noexcept { return this->m_VTable; }
+
+    _Ret operator()(_Args... args) {
+        return this->m_VTable->invoke(this->m_Storage,
+                                      std::forward<_Args>(args)...);
+    }
+
+  private:
+    struct _VTable {
+        _Ret (*invoke)(void*, _Args&&...);
+        // nullptr: trivially relocatable, the buffer is copied instead
+        void (*relocate)(void* dst, void* src) noexcept;
+        // nullptr: trivially destructible
+        void (*destroy)(void*) noexcept;
+    };
+
+    template <typename _Type> static constexpr bool _IsLocal() {
+        return sizeof(_Type) <= _BufferSize &&
+               alignof(_Type) <= alignof(std::max_align_t) &&
+               std::is_nothrow_move_constructible_v<_Type>;
+    }
+    template <typename _Type> static _Type* _get(void* storage) {
+        if constexpr (_IsLocal<_Type>())
+            return std::launder(reinterpret_cast<_Type*>(storage));
+        else
+            return *reinterpret_cast<_Type**>(storage);
+    }
+    template <typename _Type>
+    static _Ret _invoke(void* storage, _Args&&... args) {
+        return (*_get<_Type>(storage))(std::forward<_Args>(args)...);
+    }
+    template <typename _Type>
+    static void _relocate(void* dst, void* src) noexcept {
+        auto* source = _get<_Type>(src);
+        ::new (dst) _Type(std::move(*source));
+        source->~_Type();
+    }
+    template <typename _Type> static void _destroy(void* storage) noexcept {
+        if constexpr (_IsLocal<_Type>())
+            _get<_Type>(storage)->~_Type();
+        else
+            delete _get<_Type>(storage);
+    }
+    template <typename _Type>
+    static constexpr _VTable s_VTable = {
+        &_invoke<_Type>,
+        _IsLocal<_Type>() && !std::is_trivially_copyable_v<_Type>
+            ? &_relocate<_Type>
+            : nullptr,
+        _IsLocal<_Type>() && std::is_trivially_destructible_v<_Type>
+            ? nullptr
+            : &_destroy<_Type>};
+
+    void _moveFrom(UniqueFunction& rhs) noexcept {
+        this->m_VTable = rhs.m_VTable;
+        if (!this->m_VTable)
+            return;
+        if (this->m_VTable->relocate)
+            this->m_VTable->relocate(this->m_Storage, rhs.m_Storage);
+        else
+            std::memcpy(this->m_Storage, rhs.m_Storage, _BufferSize);
+        rhs.m_VTable = nullptr;
+    }
+    void _reset() noexcept {
+        if (this->m_VTable && this->m_VTable->destroy)
+            this->m_VTable->destroy(this->m_Storage);
+        this->m_VTable = nullptr;
+    }
+
+    alignas(std::max_align_t) unsigned char m_Storage[_BufferSize];
+    const _VTable* m_VTable = nullptr;
+};